@@ -0,0 +1,550 @@
+#include "coordinator.h"
+#include "env.h"
+#include "net.h"
+#include "options.h"
+
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+using namespace kami;
+using namespace std;
+
+Coordinator::Coordinator(NN* model, ReplayBuffer* replay_buffer, string addr) :
+    model(model),
+    replay_buffer(replay_buffer),
+    addr(addr),
+    running(false) {}
+
+Coordinator::~Coordinator()
+{
+    if (running)
+        stop();
+}
+
+void Coordinator::start()
+{
+    listen_fd = net::listen(addr);
+    running = true;
+    acceptor = thread(&Coordinator::accept_main, this);
+
+    cout << "COORD: listening on " << addr << endl;
+}
+
+void Coordinator::stop()
+{
+    running = false;
+
+    net::shutdown(listen_fd);
+    acceptor.join();
+    net::close(listen_fd);
+    net::unlink(addr);
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        // Closed connections' fds may have been reused
+        for (auto& c : connections)
+            if (!c.done)
+                net::shutdown(c.fd);
+    }
+
+    for (auto& c : connections)
+        c.thread.join();
+
+    connections.clear();
+
+    cout << "COORD: stopped" << endl;
+}
+
+string Coordinator::report()
+{
+    lock_guard<mutex> guard(lock);
+    stringstream out;
+
+    long games = 0, positions = 0;
+    int connected = 0;
+    float rate = 0.0f;
+
+    for (auto& w : workers)
+    {
+        out << "Worker " << w.first << " (" << w.second.name << "): "
+            << w.second.games << " games, " << w.second.positions << " positions, ";
+
+        if (w.second.connected)
+            out << w.second.positions_per_sec << " positions/s" << endl;
+        else
+            out << "disconnected" << endl;
+
+        games += w.second.games;
+        positions += w.second.positions;
+
+        if (w.second.connected)
+        {
+            rate += w.second.positions_per_sec;
+            ++connected;
+        }
+    }
+
+    out << "Total: " << connected << " connected workers, " << games << " games, " << positions << " positions, " << rate << " positions/s" << endl;
+
+    return out.str();
+}
+
+void Coordinator::accept_main()
+{
+    while (running)
+    {
+        int fd;
+
+        try {
+            fd = net::accept(listen_fd);
+        } catch (exception& e) {
+            if (running)
+                cerr << "COORD: " << e.what() << endl;
+
+            break;
+        }
+
+        lock_guard<mutex> guard(lock);
+        reap_connections();
+
+        connections.emplace_back();
+
+        Connection* c = &connections.back();
+        c->fd = fd;
+        c->thread = thread(&Coordinator::connection_main, this, c);
+    }
+}
+
+void Coordinator::reap_connections()
+{
+    for (auto it = connections.begin(); it != connections.end();)
+    {
+        if (!it->done)
+        {
+            ++it;
+            continue;
+        }
+
+        it->thread.join();
+        it = connections.erase(it);
+    }
+}
+
+string Coordinator::get_weights(int* generation)
+{
+    lock_guard<mutex> guard(lock);
+
+    int current = model->get_generation();
+
+    if (current != weights_generation)
+    {
+        stringstream out;
+        model->write(out);
+
+        weights = out.str();
+        weights_generation = current;
+    }
+
+    *generation = weights_generation;
+    return weights;
+}
+
+void Coordinator::connection_main(Connection* conn)
+{
+    int fd = conn->fd;
+    vector<char> msg;
+    int worker = -1;
+
+    try {
+        while (running)
+        {
+            uint32_t type = net::recv_msg(fd, msg);
+            net::Reader in(msg);
+            net::Writer out;
+
+            if (worker < 0 && type != MSG_HELLO)
+                throw runtime_error("expected HELLO, got message type " + to_string(type));
+
+            switch (type)
+            {
+                case MSG_HELLO:
+                {
+                    int32_t version = in.get<int32_t>();
+
+                    if (version != COORDINATOR_VERSION)
+                        throw runtime_error("worker protocol version " + to_string(version) + " does not match " + to_string(COORDINATOR_VERSION));
+
+                    string name(in.remaining(), '\0');
+                    in.get(&name[0], name.size());
+
+                    {
+                        lock_guard<mutex> guard(lock);
+                        worker = next_worker++;
+                        workers[worker].name = name;
+                    }
+
+                    cout << "COORD: worker " << worker << " (" << name << ") connected" << endl;
+
+                    out.put<int32_t>(worker);
+                    net::send_msg(fd, MSG_ACK, out.buf.data(), out.buf.size());
+                    break;
+                }
+                case MSG_GET_WEIGHTS:
+                {
+                    int32_t cached = in.get<int32_t>();
+                    int generation;
+                    string data = get_weights(&generation);
+
+                    out.put<int32_t>(generation);
+
+                    if (cached == generation)
+                    {
+                        net::send_msg(fd, MSG_WEIGHTS_CURRENT, out.buf.data(), out.buf.size());
+                        break;
+                    }
+
+                    out.put(data.data(), data.size());
+                    net::send_msg(fd, MSG_WEIGHTS, out.buf.data(), out.buf.size());
+                    break;
+                }
+                case MSG_UPLOAD:
+                {
+                    int32_t games = in.get<int32_t>();
+                    int32_t samples = in.get<int32_t>();
+
+                    vector<float> inputs(OBSIZE), mcts(PSIZE);
+
+                    for (int i = 0; i < samples; ++i)
+                    {
+                        float result = in.get<float>();
+                        uint64_t key = in.get<uint64_t>();
+                        int32_t visits = in.get<int32_t>();
+
+                        in.get(inputs.data(), sizeof(float) * OBSIZE);
+
+                        fill(mcts.begin(), mcts.end(), 0.0f);
+
+                        int32_t nonzero = in.get<int32_t>();
+
+                        for (int j = 0; j < nonzero; ++j)
+                        {
+                            int32_t action = in.get<int32_t>();
+
+                            if (action < 0 || action >= PSIZE)
+                                throw runtime_error("invalid action " + to_string(action) + " in upload");
+
+                            mcts[action] = in.get<float>();
+                        }
+
+                        replay_buffer->add(inputs.data(), mcts.data(), result, key, visits);
+                    }
+
+                    {
+                        lock_guard<mutex> guard(lock);
+                        workers[worker].games += games;
+                        workers[worker].positions += samples;
+                    }
+
+                    net::send_msg(fd, MSG_ACK);
+                    break;
+                }
+                case MSG_REPORT:
+                {
+                    int32_t games = in.get<int32_t>();
+                    int32_t positions = in.get<int32_t>();
+                    float seconds = in.get<float>();
+
+                    {
+                        lock_guard<mutex> guard(lock);
+                        workers[worker].positions_per_sec = seconds > 0.0f ? positions / seconds : 0.0f;
+                    }
+
+                    cout << "COORD: worker " << worker << ": " << games << " games, " << positions << " positions in " << seconds << "s" << endl;
+
+                    net::send_msg(fd, MSG_ACK);
+                    break;
+                }
+                default:
+                    throw runtime_error("unexpected message type " + to_string(type));
+            }
+        }
+    } catch (exception& e) {
+        if (running)
+        {
+            cout << "COORD: worker " << worker << " disconnected: " << e.what() << endl;
+
+            string err = e.what();
+
+            try {
+                net::send_msg(fd, MSG_ERROR, err.data(), err.size());
+            } catch (exception&) {}
+        }
+    }
+
+    lock_guard<mutex> guard(lock);
+
+    if (worker >= 0)
+        workers[worker].connected = false;
+
+    // Joined by the acceptor, or by stop()
+    net::close(fd);
+    conn->done = true;
+}
+
+CoordinatorClient::CoordinatorClient(string addr, string name) :
+    addr(addr),
+    name(name),
+    max_pending(max(1, options::getInt("coordinator_max_pending", 512))),
+    running(false)
+{
+    connect();
+}
+
+void CoordinatorClient::connect()
+{
+    fd = net::connect(addr);
+
+    net::Writer out;
+    out.put<int32_t>(COORDINATOR_VERSION);
+    out.put(name.data(), name.size());
+
+    net::send_msg(fd, MSG_HELLO, out.buf.data(), out.buf.size());
+
+    vector<char> msg;
+
+    if (net::recv_msg(fd, msg) != MSG_ACK)
+    {
+        net::close(fd);
+        fd = -1;
+
+        throw runtime_error("coordinator rejected worker: " + string(msg.begin(), msg.end()));
+    }
+
+    net::Reader in(msg);
+    worker_id = in.get<int32_t>();
+}
+
+CoordinatorClient::~CoordinatorClient()
+{
+    if (running)
+        stop_worker();
+
+    if (fd >= 0)
+        net::close(fd);
+}
+
+bool CoordinatorClient::fetch_weights(NN* model)
+{
+    net::Writer out;
+    out.put<int32_t>(cached_generation);
+
+    net::send_msg(fd, MSG_GET_WEIGHTS, out.buf.data(), out.buf.size());
+
+    vector<char> msg;
+    uint32_t type = net::recv_msg(fd, msg);
+    net::Reader in(msg);
+
+    if (type == MSG_WEIGHTS_CURRENT)
+        return false;
+
+    if (type != MSG_WEIGHTS)
+        throw runtime_error("unexpected reply to weights request: " + string(msg.begin(), msg.end()));
+
+    int generation = in.get<int32_t>();
+
+    stringstream data(string(msg.begin() + sizeof(int32_t), msg.end()));
+    model->read(data);
+
+    cached_generation = generation;
+    return true;
+}
+
+void CoordinatorClient::upload(vector<vector<Selfplay::Sample>>& games)
+{
+    // Well under net::MAX_PAYLOAD, a message is sent once it passes this
+    const size_t chunk_bytes = 16 << 20;
+
+    while (games.size())
+    {
+        net::Writer out;
+        int32_t count = 0, samples = 0;
+
+        // Game and sample counts, filled in once the chunk is built
+        out.put<int32_t>(0);
+        out.put<int32_t>(0);
+
+        for (; count < games.size() && out.buf.size() < chunk_bytes; ++count)
+        {
+            for (auto& s : games[count])
+            {
+                out.put<float>(s.result);
+                out.put<uint64_t>(s.key);
+                out.put<int32_t>(s.visits);
+                out.put(s.inputs.data(), sizeof(float) * OBSIZE);
+
+                // Search policies are sparse, only send visited actions
+                int32_t nonzero = 0;
+
+                for (float p : s.mcts)
+                    nonzero += p != 0.0f;
+
+                out.put<int32_t>(nonzero);
+
+                for (int32_t a = 0; a < PSIZE; ++a)
+                {
+                    if (s.mcts[a] != 0.0f)
+                    {
+                        out.put<int32_t>(a);
+                        out.put<float>(s.mcts[a]);
+                    }
+                }
+            }
+
+            samples += games[count].size();
+        }
+
+        memcpy(&out.buf[0], &count, sizeof(count));
+        memcpy(&out.buf[sizeof(count)], &samples, sizeof(samples));
+
+        net::send_msg(fd, MSG_UPLOAD, out.buf.data(), out.buf.size());
+
+        vector<char> msg;
+
+        if (net::recv_msg(fd, msg) != MSG_ACK)
+            throw runtime_error("upload failed: " + string(msg.begin(), msg.end()));
+
+        games.erase(games.begin(), games.begin() + count);
+    }
+}
+
+void CoordinatorClient::report(int games, int positions, float seconds)
+{
+    net::Writer out;
+    out.put<int32_t>(games);
+    out.put<int32_t>(positions);
+    out.put<float>(seconds);
+
+    net::send_msg(fd, MSG_REPORT, out.buf.data(), out.buf.size());
+
+    vector<char> msg;
+
+    if (net::recv_msg(fd, msg) != MSG_ACK)
+        throw runtime_error("report failed: " + string(msg.begin(), msg.end()));
+}
+
+void CoordinatorClient::start_worker(Selfplay* selfplay, NN* model, int sync_ms)
+{
+    selfplay->set_game_sink([this](vector<Selfplay::Sample>& game) { queue(game); });
+
+    fetch_weights(model);
+
+    running = true;
+    worker = thread(&CoordinatorClient::worker_main, this, model, sync_ms);
+}
+
+void CoordinatorClient::queue(vector<Selfplay::Sample>& game)
+{
+    lock_guard<mutex> guard(pending_lock);
+
+    pending.push_back(move(game));
+    trim_pending();
+}
+
+int CoordinatorClient::pending_games()
+{
+    lock_guard<mutex> guard(pending_lock);
+    return pending.size();
+}
+
+void CoordinatorClient::trim_pending()
+{
+    if (pending.size() <= max_pending)
+        return;
+
+    dropped += pending.size() - max_pending;
+    pending.erase(pending.begin(), pending.end() - max_pending);
+}
+
+void CoordinatorClient::stop_worker()
+{
+    running = false;
+    worker.join();
+}
+
+void CoordinatorClient::worker_main(NN* model, int sync_ms)
+{
+    auto last = chrono::steady_clock::now();
+
+    int backoff_ms = 1000;
+
+    while (running)
+    {
+        int wait_ms = fd < 0 ? backoff_ms : sync_ms;
+
+        // Sleep in slices so stop_worker() isn't held up by a long backoff
+        for (auto until = chrono::steady_clock::now() + chrono::milliseconds(wait_ms); running && chrono::steady_clock::now() < until;)
+            this_thread::sleep_for(chrono::milliseconds(100));
+
+        if (!running)
+            break;
+
+        if (fd < 0)
+        {
+            try {
+                connect();
+            } catch (exception& e) {
+                backoff_ms = min(backoff_ms * 2, 60000);
+
+                lock_guard<mutex> guard(pending_lock);
+                cerr << "WORKER: reconnect failed (" << e.what() << "), " << pending.size() << " games pending, "
+                     << dropped << " dropped, retrying in " << backoff_ms / 1000 << "s" << endl;
+                continue;
+            }
+
+            backoff_ms = 1000;
+            cout << "WORKER " << worker_id << ": reconnected to coordinator" << endl;
+        }
+
+        vector<vector<Selfplay::Sample>> games;
+
+        {
+            lock_guard<mutex> guard(pending_lock);
+            games.swap(pending);
+        }
+
+        int uploaded = games.size(), positions = 0;
+
+        for (auto& g : games)
+            positions += g.size();
+
+        try {
+            upload(games);
+
+            auto now = chrono::steady_clock::now();
+            report(uploaded, positions, chrono::duration<float>(now - last).count());
+            last = now;
+
+            if (fetch_weights(model))
+                cout << "WORKER " << worker_id << ": using generation " << model->get_generation() << endl;
+        } catch (exception& e) {
+            cerr << "WORKER " << worker_id << ": coordinator sync failed: " << e.what() << endl;
+
+            net::close(fd);
+            fd = -1;
+        }
+
+        if (!games.size())
+            continue;
+
+        // Requeue what wasn't acknowledged ahead of newer games, keeping
+        // the newest if too many pile up
+        lock_guard<mutex> guard(pending_lock);
+
+        pending.insert(pending.begin(), make_move_iterator(games.begin()), make_move_iterator(games.end()));
+        trim_pending();
+    }
+}
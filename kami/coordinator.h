@@ -0,0 +1,171 @@
+#pragma once
+
+#include "nn/nn.h"
+#include "replaybuffer.h"
+#include "selfplay.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Multi-node selfplay.
+ *
+ * A learner runs a Coordinator which serves the current model weights and
+ * feeds uploaded games into its replay buffer. Workers run selfplay locally
+ * and use a CoordinatorClient to fetch weights (only when the generation
+ * changed), upload finished games in batches and report throughput.
+ *
+ * Protocol (see net.h for framing):
+ *   HELLO         int32 version, worker name       -> ACK int32 worker id
+ *   GET_WEIGHTS   int32 cached generation          -> WEIGHTS int32 generation, model
+ *                                                     or WEIGHTS_CURRENT int32 generation
+ *   UPLOAD        int32 games, int32 samples,
+ *                 samples                          -> ACK
+ *   REPORT        int32 games, int32 positions,
+ *                 float seconds                    -> ACK
+ *
+ * Each uploaded sample is: float result, uint64 key, int32 visits, OBSIZE
+ * floats of observation, int32 nonzero policy entries and that many
+ * (int32 action, float probability) pairs.
+ */
+
+namespace kami {
+
+enum CoordinatorMessage : uint32_t {
+    MSG_HELLO = 1,
+    MSG_GET_WEIGHTS,
+    MSG_WEIGHTS,
+    MSG_WEIGHTS_CURRENT,
+    MSG_UPLOAD,
+    MSG_REPORT,
+    MSG_ACK,
+    MSG_ERROR,
+};
+
+constexpr int32_t COORDINATOR_VERSION = 1;
+
+class Coordinator {
+    public:
+        Coordinator(NN* model, ReplayBuffer* replay_buffer, std::string addr);
+        ~Coordinator();
+
+        void start();
+        void stop();
+
+        std::string report();
+
+    private:
+        struct WorkerInfo {
+            std::string name;
+            bool connected = true;
+            long games = 0, positions = 0;
+            float positions_per_sec = 0.0f;
+        };
+
+        NN* model;
+        ReplayBuffer* replay_buffer;
+        std::string addr;
+
+        // A worker connection, closed once `done`
+        struct Connection {
+            int fd;
+            std::thread thread;
+            bool done = false;
+        };
+
+        int listen_fd = -1;
+        std::atomic<bool> running;
+        std::thread acceptor;
+        std::list<Connection> connections;
+
+        std::mutex lock;
+        std::map<int, WorkerInfo> workers;
+        int next_worker = 0;
+
+        // Serialized weights are cached per generation
+        std::string weights;
+        int weights_generation = -1;
+
+        void accept_main();
+        void connection_main(Connection* conn);
+
+        // Join the threads of closed connections, must hold lock
+        void reap_connections();
+        std::string get_weights(int* generation);
+};
+
+class CoordinatorClient {
+    public:
+        CoordinatorClient(std::string addr, std::string name);
+        ~CoordinatorClient();
+
+        /**
+         * Loads the coordinator's model into `model` if its generation differs
+         * from the last one fetched. Returns true if weights were loaded.
+         */
+        bool fetch_weights(NN* model);
+
+        /**
+         * Uploads games in messages of bounded size. Games are removed from
+         * `games` as the coordinator acknowledges them, so after a failure it
+         * holds the games still to send.
+         */
+        void upload(std::vector<std::vector<Selfplay::Sample>>& games);
+        void report(int games, int positions, float seconds);
+
+        int id() { return worker_id; }
+
+        /**
+         * Queues a finished game for the next upload. Past
+         * coordinator_max_pending games the oldest are dropped, so an
+         * unreachable coordinator can't run the worker out of memory.
+         */
+        void queue(std::vector<Selfplay::Sample>& game);
+
+        // Games waiting for upload, and games dropped over the limit
+        int pending_games();
+        long dropped_games() { return dropped; }
+
+        /**
+         * Runs a selfplay worker: games from `selfplay` are queued and
+         * uploaded, throughput is reported and weights refreshed every
+         * `sync_ms`. Call before selfplay->start().
+         *
+         * If the coordinator goes away, games are kept (up to
+         * coordinator_max_pending, oldest dropped first) and the worker
+         * reconnects with exponential backoff.
+         */
+        void start_worker(Selfplay* selfplay, NN* model, int sync_ms);
+        void stop_worker();
+
+    private:
+        std::string addr, name;
+
+        int fd = -1;
+        int worker_id = -1;
+        int cached_generation = -1;
+
+        std::mutex pending_lock;
+        std::vector<std::vector<Selfplay::Sample>> pending;
+        size_t max_pending;
+        std::atomic<long> dropped{0};
+
+        // Drop the oldest games over max_pending, must hold pending_lock
+        void trim_pending();
+
+        std::atomic<bool> running;
+        std::thread worker;
+
+        // Connect and say hello, setting fd and worker_id
+        void connect();
+
+        void worker_main(NN* model, int sync_ms);
+};
+} // namespace kami
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <cstdint>
 #include <iostream>
 
 #include <vector>
@@ -57,6 +58,9 @@ class Env {
 
         int ply() { return history.size(); }
 
+        // Zobrist key of the current position
+        uint64_t key() { return ncPositionGetKey(&game); }
+
         int encode(ncMove move) 
         {
             assert(ncMoveValid(move));
@@ -473,6 +477,13 @@ class Env {
             return output + " " + result;
         }
 
+        size_t bytes()
+        {
+            return sizeof(Env)
+                + history.capacity() * sizeof(ncMove)
+                + cur_actions.capacity() * sizeof(int);
+        }
+
         float bootstrap_value(float window)
         {
             float score = (float) ncPositionEvaluate(&game) / window;
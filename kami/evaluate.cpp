@@ -2,12 +2,13 @@
 #include "env.h"
 #include "mcts.h"
 #include "options.h"
+#include "random.h"
 
 #include <iostream>
 
 using namespace kami;
 
-bool kami::eval(NN* current_model, NN* candidate_model, int trainer)
+bool kami::eval(NN* current_model, NN* candidate_model, int trainer, SearchStats* stats)
 {
     int ebatch = options::getInt("evaluate_batch");
     int egames = options::getInt("evaluate_games");
@@ -19,7 +20,7 @@ bool kami::eval(NN* current_model, NN* candidate_model, int trainer)
 
     // Each model plays first half 1, second half -1
     for (int i = 0; i < ebatch; ++i)
-        candidate_turns[i] = (rand() % 2) * 2 - 1;
+        candidate_turns[i] = thread_rng().below(2) * 2 - 1;
 
     // Input buffers
     float* cur_inputs = new float[ebatch * 8 * 8 * NFEATURES];
@@ -94,6 +95,9 @@ bool kami::eval(NN* current_model, NN* candidate_model, int trainer)
             // Make action
             trees[i].push(trees[i].pick());
 
+            if (stats)
+                stats->merge(trees[i].last_search_stats());
+
             if (trees[i].get_env().terminal(&tvalue))
             {
                 // Check result
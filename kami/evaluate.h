@@ -1,7 +1,9 @@
 #pragma once
 
+#include "mcts.h"
 #include "nn/nn.h"
 
 namespace kami {
-    bool eval(NN* current_model, NN* candidate_model, int trainer);
+    // If given, `stats` accumulates the search statistics of every move played
+    bool eval(NN* current_model, NN* candidate_model, int trainer, SearchStats* stats = nullptr);
 }
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "env.h"
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <utility>
+#include <vector>
+
+/**
+ * Coroutine game driver.
+ *
+ * Each game is a coroutine which runs its search until it needs a network
+ * evaluation. It first co_awaits InferenceBatcher::reserve() for room in the
+ * batch, writes its observation to input() and suspends on evaluate(). Once
+ * the batch is full the caller runs inference over it, and complete()
+ * resumes every game in the batch with its result. Each resumed game expands
+ * its tree straight away (results are overwritten by the next batch) and
+ * queues behind the other games for its next slot, so one thread can
+ * interleave any number of games with no per-game bookkeeping in the driver.
+ *
+ * Requires C++20.
+ */
+
+namespace kami {
+
+class GameTask {
+    public:
+        struct promise_type {
+            std::exception_ptr error;
+
+            GameTask get_return_object() { return GameTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+            // Games start right away and run to their first reserve()
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+
+        typedef std::coroutine_handle<promise_type> Handle;
+
+        explicit GameTask(Handle handle) : handle(handle) {}
+        GameTask(GameTask&& other) : handle(std::exchange(other.handle, nullptr)) {}
+        GameTask(const GameTask&) = delete;
+
+        ~GameTask()
+        {
+            // Destroying a suspended game releases everything in its frame
+            if (handle)
+                handle.destroy();
+        }
+
+        Handle handle;
+};
+
+class InferenceBatcher {
+    public:
+        /**
+         * Batches of up to `batch` observations are built in `inputs`, and
+         * results are read from `policy` and `value` after inference.
+         */
+        InferenceBatcher(int batch, float* inputs, float* policy, float* value) :
+            batch(batch),
+            inputs(inputs),
+            policy(policy),
+            value(value) {}
+
+        struct Result {
+            float* policy;
+            float value;
+        };
+
+        struct ReserveAwaiter {
+            InferenceBatcher* batcher;
+
+            // Games already queued go first
+            bool await_ready() { return batcher->ready.empty() && batcher->waiting.size() < batcher->batch; }
+            void await_suspend(GameTask::Handle handle) { batcher->ready.push_back(handle); }
+            void await_resume() {}
+        };
+
+        struct Awaiter {
+            InferenceBatcher* batcher;
+            int slot = -1;
+
+            bool await_ready() { return false; }
+
+            void await_suspend(GameTask::Handle handle)
+            {
+                slot = batcher->waiting.size();
+                batcher->waiting.push_back(handle);
+            }
+
+            Result await_resume() { return { batcher->policy + slot * PSIZE, batcher->value[slot] }; }
+        };
+
+        // Wait for room in the batch
+        ReserveAwaiter reserve() { return { this }; }
+
+        /**
+         * Buffer for the observation of the next evaluate(). Only valid
+         * after reserve(), until the game suspends.
+         */
+        float* input() { return inputs + waiting.size() * OBSIZE; }
+
+        Awaiter evaluate() { return { this }; }
+
+        /**
+         * Resumes queued games until the batch is full. Returns the number of
+         * observations in the batch.
+         */
+        int fill()
+        {
+            while (waiting.size() < batch && ready.size())
+            {
+                GameTask::Handle handle = ready.front();
+                ready.pop_front();
+
+                resume(handle);
+            }
+
+            return waiting.size();
+        }
+
+        /**
+         * Call once inference has written the batch's results: resumes every
+         * game in the batch, each running on to its next evaluation.
+         */
+        void complete()
+        {
+            std::vector<GameTask::Handle> batch_games;
+            batch_games.swap(waiting);
+
+            for (auto& handle : batch_games)
+                resume(handle);
+        }
+
+        int size() { return waiting.size(); }
+
+        // Rethrows an exception which ended a game
+        static void check(GameTask& task)
+        {
+            if (task.handle.promise().error)
+                std::rethrow_exception(task.handle.promise().error);
+        }
+
+    private:
+        int batch;
+        float* inputs, *policy, *value;
+
+        std::deque<GameTask::Handle> ready;
+        std::vector<GameTask::Handle> waiting;
+
+        void resume(GameTask::Handle handle)
+        {
+            handle.resume();
+
+            if (handle.promise().error)
+                std::rethrow_exception(handle.promise().error);
+        }
+};
+} // namespace kami
@@ -0,0 +1,556 @@
+#include "inferenceserver.h"
+#include "net.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace kami;
+using namespace std;
+
+InferenceServer::InferenceServer(NN* model, string addr, int max_batch, int wait_us) :
+    model(model),
+    addr(addr),
+    max_batch(max_batch),
+    wait_us(wait_us),
+    running(false)
+{
+    if (addr.rfind("unix:", 0) != 0)
+        throw runtime_error("inference server needs a unix: address, clients share memory with it");
+}
+
+InferenceServer::~InferenceServer()
+{
+    if (running)
+        stop();
+}
+
+InferenceServer::Client::~Client()
+{
+    if (shm)
+        munmap(shm, shm_bytes);
+
+    net::close(fd);
+}
+
+void InferenceServer::start()
+{
+    listen_fd = net::listen(addr);
+    running = true;
+    acceptor = thread(&InferenceServer::accept_main, this);
+    batcher = thread(&InferenceServer::batch_main, this);
+
+    cout << "INFER: listening on " << addr << " (batch " << max_batch << ", wait " << wait_us << "us)" << endl;
+}
+
+void InferenceServer::stop()
+{
+    {
+        // Under the lock so the batcher can't miss the wakeup
+        lock_guard<mutex> guard(lock);
+        running = false;
+    }
+
+    net::shutdown(listen_fd);
+    acceptor.join();
+    net::close(listen_fd);
+    net::unlink(addr);
+
+    cv.notify_all();
+    batcher.join();
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        pending.clear();
+        pending_batch = 0;
+
+        for (auto& c : clients)
+        {
+            if (auto client = c.lock())
+                net::shutdown(client->fd);
+        }
+    }
+
+    for (auto& t : connections)
+        t.join();
+
+    connections.clear();
+    clients.clear();
+
+    cout << "INFER: stopped" << endl;
+}
+
+string InferenceServer::report()
+{
+    lock_guard<mutex> guard(lock);
+    stringstream out;
+
+    int connected = 0;
+
+    for (auto& c : clients)
+        connected += !c.expired();
+
+    out << "Inference server: " << connected << " clients, " << batches << " batches, "
+        << requests << " requests, " << observations << " observations";
+
+    if (batches)
+        out << ", " << (float) observations / batches << " observations/batch";
+
+    out << endl;
+
+    if (batches)
+        out << "Inference server copies: " << batches - in_place << " merged batches, " << copy_us / 1000 << "ms copying vs "
+            << infer_us / 1000 << "ms inferring (" << (copy_us + infer_us ? 100.0f * copy_us / (copy_us + infer_us) : 0.0f) << "%)" << endl;
+
+    return out.str();
+}
+
+void InferenceServer::accept_main()
+{
+    while (running)
+    {
+        int fd;
+
+        try {
+            fd = net::accept(listen_fd);
+        } catch (exception& e) {
+            if (running)
+                cerr << "INFER: " << e.what() << endl;
+
+            break;
+        }
+
+        lock_guard<mutex> guard(lock);
+        connections.push_back(thread(&InferenceServer::connection_main, this, fd));
+    }
+}
+
+void InferenceServer::connection_main(int fd)
+{
+    vector<char> msg;
+    shared_ptr<Client> client;
+
+    try {
+        if (net::recv_msg(fd, msg) != INF_HELLO)
+            throw runtime_error("expected HELLO");
+
+        net::Reader in(msg);
+
+        int32_t version = in.get<int32_t>();
+        int32_t slots = in.get<int32_t>();
+        int32_t slot_batch = in.get<int32_t>();
+        int32_t obsize = in.get<int32_t>();
+        int32_t psize = in.get<int32_t>();
+
+        string name(in.remaining(), '\0');
+        in.get(&name[0], name.size());
+
+        if (version != INFERENCE_VERSION)
+            throw runtime_error("client protocol version " + to_string(version) + " does not match " + to_string(INFERENCE_VERSION));
+
+        if (obsize != model->obsize() || psize != model->polsize())
+            throw runtime_error("client observation/policy size does not match the model");
+
+        if (slots <= 0 || slot_batch <= 0 || slot_batch > max_batch)
+            throw runtime_error("client slot batch " + to_string(slot_batch) + " exceeds server batch " + to_string(max_batch));
+
+        size_t slot_floats = (size_t) slot_batch * (OBSIZE + PSIZE + 1);
+        size_t shm_bytes = sizeof(float) * slots * slot_floats;
+
+        if (slot_floats > (size_t) max_batch * (OBSIZE + PSIZE + 1))
+            throw runtime_error("client slots are larger than a server batch");
+
+        int shm_fd = shm_open(name.c_str(), O_RDWR, 0);
+
+        if (shm_fd < 0)
+            throw runtime_error("couldn't open shared memory " + name + ": " + strerror(errno));
+
+        // Touching pages past the end of the object would fault the server
+        struct stat st;
+
+        if (fstat(shm_fd, &st) < 0 || (size_t) st.st_size < shm_bytes)
+        {
+            ::close(shm_fd);
+            throw runtime_error("shared memory " + name + " is smaller than " + to_string(slots) + " slots of " + to_string(slot_batch));
+        }
+
+        void* mem = mmap(nullptr, shm_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        ::close(shm_fd);
+
+        if (mem == MAP_FAILED)
+            throw runtime_error("couldn't map shared memory " + name + ": " + strerror(errno));
+
+        client = make_shared<Client>();
+        client->fd = fd;
+        client->slots = slots;
+        client->slot_batch = slot_batch;
+        client->slot_floats = slot_floats;
+        client->shm = (float*) mem;
+        client->shm_bytes = shm_bytes;
+
+        {
+            lock_guard<mutex> guard(lock);
+            client->id = next_client++;
+            clients.push_back(client);
+        }
+
+        net::Writer out;
+        out.put<int32_t>(client->id);
+        out.put<int32_t>(model->get_generation());
+        net::send_msg(fd, INF_ACK, out.buf.data(), out.buf.size());
+
+        cout << "INFER: client " << client->id << " connected with " << slots << " slots of " << slot_batch << endl;
+
+        while (running)
+        {
+            if (net::recv_msg(fd, msg) != INF_SUBMIT)
+                throw runtime_error("expected SUBMIT");
+
+            net::Reader req(msg);
+
+            int32_t slot = req.get<int32_t>();
+            int32_t batch = req.get<int32_t>();
+
+            if (slot < 0 || slot >= slots || batch <= 0 || batch > slot_batch)
+                throw runtime_error("invalid request for slot " + to_string(slot) + " batch " + to_string(batch));
+
+            {
+                lock_guard<mutex> guard(lock);
+                pending.push_back({ client, slot, batch });
+                pending_batch += batch;
+            }
+
+            cv.notify_one();
+        }
+    } catch (exception& e) {
+        if (running)
+        {
+            cout << "INFER: client " << (client ? client->id : -1) << " disconnected: " << e.what() << endl;
+
+            if (!client)
+            {
+                string err = e.what();
+
+                try {
+                    net::send_msg(fd, INF_ERROR, err.data(), err.size());
+                } catch (exception&) {}
+            }
+        }
+    }
+
+    // Pending requests may still hold the client, it closes with the last one
+    if (!client)
+        net::close(fd);
+}
+
+void InferenceServer::batch_main()
+{
+    float* inputs = new float[max_batch * OBSIZE];
+    float* policy = new float[max_batch * PSIZE];
+    float* value = new float[max_batch];
+
+    vector<Request> batch;
+
+    while (running)
+    {
+        int total = 0;
+
+        {
+            unique_lock<mutex> guard(lock);
+
+            cv.wait(guard, [&]() { return !running || pending.size(); });
+
+            if (!running)
+                break;
+
+            // Give other clients a moment to fill the batch
+            auto deadline = chrono::steady_clock::now() + chrono::microseconds(wait_us);
+            cv.wait_until(guard, deadline, [&]() { return !running || pending_batch >= max_batch; });
+
+            while (pending.size() && total + pending.front().batch <= max_batch)
+            {
+                total += pending.front().batch;
+                pending_batch -= pending.front().batch;
+                batch.push_back(move(pending.front()));
+                pending.pop_front();
+            }
+
+            ++batches;
+            requests += batch.size();
+            observations += total;
+        }
+
+        auto us_since = [](chrono::steady_clock::time_point start) {
+            return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        };
+
+        long batch_copy_us = 0, batch_infer_us = 0;
+
+        if (batch.size() == 1)
+        {
+            // Nothing to merge, infer straight from and into the slot
+            Request& r = batch[0];
+            auto start = chrono::steady_clock::now();
+
+            model->infer(r.client->inputs(r.slot), r.batch, r.client->policy(r.slot), r.client->value(r.slot));
+            batch_infer_us = us_since(start);
+        }
+        else
+        {
+            auto start = chrono::steady_clock::now();
+            int offset = 0;
+
+            for (auto& r : batch)
+            {
+                memcpy(inputs + offset * OBSIZE, r.client->inputs(r.slot), sizeof(float) * r.batch * OBSIZE);
+                offset += r.batch;
+            }
+
+            batch_copy_us = us_since(start);
+            start = chrono::steady_clock::now();
+
+            model->infer(inputs, total, policy, value);
+
+            batch_infer_us = us_since(start);
+            start = chrono::steady_clock::now();
+            offset = 0;
+
+            for (auto& r : batch)
+            {
+                memcpy(r.client->policy(r.slot), policy + offset * PSIZE, sizeof(float) * r.batch * PSIZE);
+                memcpy(r.client->value(r.slot), value + offset, sizeof(float) * r.batch);
+                offset += r.batch;
+            }
+
+            batch_copy_us += us_since(start);
+        }
+
+        {
+            lock_guard<mutex> guard(lock);
+
+            in_place += batch.size() == 1;
+            copy_us += batch_copy_us;
+            infer_us += batch_infer_us;
+        }
+
+        int32_t generation = model->get_generation();
+
+        for (auto& r : batch)
+        {
+            int32_t done[2] = { r.slot, generation };
+
+            try {
+                net::send_msg(r.client->fd, INF_DONE, done, sizeof(done));
+            } catch (exception&) {
+                // Client went away, its connection thread reports it
+            }
+        }
+
+        batch.clear();
+    }
+
+    delete[] inputs;
+    delete[] policy;
+    delete[] value;
+}
+
+InferenceClient::InferenceClient(string addr, int slots, int slot_batch) :
+    slots(slots),
+    slot_batch(slot_batch),
+    slot_floats((size_t) slot_batch * (OBSIZE + PSIZE + 1)),
+    shm_bytes(sizeof(float) * slots * slot_floats),
+    slot_free(slots, true),
+    slot_done(slots, false),
+    generation(0)
+{
+    static atomic<int> instances(0);
+    string name = "/kami-inference-" + to_string(getpid()) + "-" + to_string(instances++);
+
+    int shm_fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if (shm_fd < 0)
+        throw runtime_error("couldn't create shared memory " + name + ": " + strerror(errno));
+
+    if (ftruncate(shm_fd, shm_bytes) < 0)
+    {
+        ::close(shm_fd);
+        shm_unlink(name.c_str());
+        throw runtime_error("couldn't size shared memory " + name + ": " + strerror(errno));
+    }
+
+    void* mem = mmap(nullptr, shm_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    ::close(shm_fd);
+
+    if (mem == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        throw runtime_error("couldn't map shared memory " + name + ": " + strerror(errno));
+    }
+
+    shm = (float*) mem;
+
+    vector<char> msg;
+
+    try {
+        fd = net::connect(addr);
+
+        net::Writer out;
+        out.put<int32_t>(INFERENCE_VERSION);
+        out.put<int32_t>(slots);
+        out.put<int32_t>(slot_batch);
+        out.put<int32_t>(OBSIZE);
+        out.put<int32_t>(PSIZE);
+        out.put(name.data(), name.size());
+
+        net::send_msg(fd, INF_HELLO, out.buf.data(), out.buf.size());
+
+        if (net::recv_msg(fd, msg) != INF_ACK)
+            throw runtime_error("inference server rejected client: " + string(msg.begin(), msg.end()));
+    } catch (exception&) {
+        shm_unlink(name.c_str());
+        munmap(shm, shm_bytes);
+        throw;
+    }
+
+    // Both sides have it mapped now, drop the name so nothing leaks
+    shm_unlink(name.c_str());
+
+    net::Reader in(msg);
+    in.get<int32_t>();
+    generation = in.get<int32_t>();
+
+    reader = thread(&InferenceClient::reader_main, this);
+}
+
+InferenceClient::~InferenceClient()
+{
+    net::shutdown(fd);
+    reader.join();
+    net::close(fd);
+
+    munmap(shm, shm_bytes);
+}
+
+int InferenceClient::acquire()
+{
+    unique_lock<mutex> guard(lock);
+
+    int slot = -1;
+
+    cv.wait(guard, [&]() {
+        for (slot = 0; slot < slots; ++slot)
+            if (slot_free[slot])
+                return true;
+
+        return false;
+    });
+
+    slot_free[slot] = false;
+    return slot;
+}
+
+void InferenceClient::release(int slot)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        slot_free[slot] = true;
+    }
+
+    cv.notify_all();
+}
+
+void InferenceClient::submit(int slot, int batch)
+{
+    {
+        lock_guard<mutex> guard(lock);
+
+        if (error.size())
+            throw runtime_error("inference server connection lost: " + error);
+
+        slot_done[slot] = false;
+    }
+
+    int32_t req[2] = { slot, batch };
+
+    lock_guard<mutex> guard(send_lock);
+    net::send_msg(fd, INF_SUBMIT, req, sizeof(req));
+}
+
+void InferenceClient::wait(int slot)
+{
+    unique_lock<mutex> guard(lock);
+
+    cv.wait(guard, [&]() { return slot_done[slot] || error.size(); });
+
+    if (!slot_done[slot])
+        throw runtime_error("inference server connection lost: " + error);
+}
+
+void InferenceClient::infer(float* input, int batch, float* policy, float* value)
+{
+    int slot = acquire();
+
+    try {
+        for (int done = 0; done < batch; done += slot_batch)
+        {
+            int n = min(slot_batch, batch - done);
+
+            memcpy(inputs(slot), input + done * OBSIZE, sizeof(float) * n * OBSIZE);
+
+            submit(slot, n);
+            wait(slot);
+
+            memcpy(policy + done * PSIZE, this->policy(slot), sizeof(float) * n * PSIZE);
+            memcpy(value + done, this->value(slot), sizeof(float) * n);
+        }
+    } catch (exception&) {
+        release(slot);
+        throw;
+    }
+
+    release(slot);
+}
+
+void InferenceClient::reader_main()
+{
+    vector<char> msg;
+
+    try {
+        while (1)
+        {
+            if (net::recv_msg(fd, msg) != INF_DONE)
+                throw runtime_error("unexpected message from inference server");
+
+            net::Reader in(msg);
+
+            int32_t slot = in.get<int32_t>();
+            generation = in.get<int32_t>();
+
+            if (slot < 0 || slot >= slots)
+                throw runtime_error("inference server answered invalid slot " + to_string(slot));
+
+            {
+                lock_guard<mutex> guard(lock);
+                slot_done[slot] = true;
+            }
+
+            cv.notify_all();
+        }
+    } catch (exception& e) {
+        {
+            lock_guard<mutex> guard(lock);
+            error = e.what();
+        }
+
+        cv.notify_all();
+    }
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "env.h"
+#include "nn/nn.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Shared inference.
+ *
+ * An InferenceServer owns a model and serves several processes on the same
+ * host. Each InferenceClient maps a shared memory region divided into slots;
+ * a slot holds the observations of one request and receives its policies and
+ * values. Only slot numbers travel over the unix socket. The server merges
+ * pending requests from all clients into one large NN::infer batch, which
+ * takes two copies: observations are gathered from the slots into one input
+ * buffer, and results are scattered back. A batch of a single request is
+ * inferred in place in its slot. report() gives the time spent copying.
+ *
+ * Protocol (see net.h for framing):
+ *   HELLO   int32 version, int32 slots, int32 slot batch, int32 obsize,
+ *           int32 psize, shared memory name   -> ACK int32 client id, int32 generation
+ *   SUBMIT  int32 slot, int32 batch           -> (when inferred) DONE int32 slot, int32 generation
+ *
+ * Slot layout: slot batch * obsize floats of input, slot batch * psize floats
+ * of policy and slot batch floats of value.
+ */
+
+namespace kami {
+
+enum InferenceMessage : uint32_t {
+    INF_HELLO = 1,
+    INF_SUBMIT,
+    INF_DONE,
+    INF_ACK,
+    INF_ERROR,
+};
+
+constexpr int32_t INFERENCE_VERSION = 1;
+
+class InferenceServer {
+    public:
+        /**
+         * Serves `model` on `addr` (a unix: address). Requests are merged up
+         * to `max_batch` observations, waiting at most `wait_us` after the
+         * first pending request for more to arrive.
+         */
+        InferenceServer(NN* model, std::string addr, int max_batch, int wait_us);
+        ~InferenceServer();
+
+        void start();
+        void stop();
+
+        std::string report();
+
+    private:
+        struct Client {
+            ~Client();
+
+            int id, fd;
+            int slots, slot_batch;
+            size_t slot_floats;
+            float* shm = nullptr;
+            size_t shm_bytes = 0;
+
+            float* inputs(int slot) { return shm + slot * slot_floats; }
+            float* policy(int slot) { return inputs(slot) + slot_batch * OBSIZE; }
+            float* value(int slot) { return policy(slot) + slot_batch * PSIZE; }
+        };
+
+        struct Request {
+            std::shared_ptr<Client> client;
+            int slot, batch;
+        };
+
+        NN* model;
+        std::string addr;
+        int max_batch, wait_us;
+
+        int listen_fd = -1;
+        std::atomic<bool> running;
+        std::thread acceptor, batcher;
+        std::vector<std::thread> connections;
+
+        std::mutex lock;
+        std::condition_variable cv;
+        std::deque<Request> pending;
+        int pending_batch = 0;
+        std::vector<std::weak_ptr<Client>> clients;
+        int next_client = 0;
+
+        // Batching statistics, and microseconds spent gathering and
+        // scattering merged batches against inference itself
+        long batches = 0, requests = 0, observations = 0, in_place = 0;
+        long copy_us = 0, infer_us = 0;
+
+        void accept_main();
+        void connection_main(int fd);
+        void batch_main();
+};
+
+class InferenceClient {
+    public:
+        /**
+         * Connects to a server at `addr` with `slots` concurrent requests of
+         * up to `slot_batch` observations each.
+         */
+        InferenceClient(std::string addr, int slots, int slot_batch);
+        ~InferenceClient();
+
+        /**
+         * Same contract as NN::infer. Copies through a free slot; callers
+         * which can fill shared memory directly should use the slot API.
+         */
+        void infer(float* input, int batch, float* policy, float* value);
+
+        // Zero-copy interface: acquire a slot, write observations to
+        // inputs(slot), submit and wait, read policy(slot) and value(slot)
+        int acquire();
+        void release(int slot);
+        void submit(int slot, int batch);
+        void wait(int slot);
+
+        float* inputs(int slot) { return shm + slot * slot_floats; }
+        float* policy(int slot) { return inputs(slot) + slot_batch * OBSIZE; }
+        float* value(int slot) { return policy(slot) + slot_batch * PSIZE; }
+
+        int get_slots() { return slots; }
+        int get_slot_batch() { return slot_batch; }
+
+        // Generation of the server model which answered the last request
+        int get_generation() { return generation; }
+
+    private:
+        int fd;
+        int slots, slot_batch;
+        size_t slot_floats;
+        float* shm = nullptr;
+        size_t shm_bytes = 0;
+
+        // Threads share the socket, messages must not interleave
+        std::mutex send_lock;
+
+        std::mutex lock;
+        std::condition_variable cv;
+        std::vector<bool> slot_free, slot_done;
+        std::atomic<int> generation;
+        std::string error;
+
+        std::thread reader;
+
+        void reader_main();
+};
+} // namespace kami
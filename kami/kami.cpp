@@ -1,12 +1,19 @@
 #include "selfplay.h"
+#include "coordinator.h"
 #include "env.h"
+#include "inferenceserver.h"
+#include "mcts.h"
 #include "options.h"
+#include "random.h"
 
 #include <ctime>
 #include <iostream>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <memory>
+
+#include <unistd.h>
 
 using namespace kami;
 using namespace std;
@@ -32,7 +39,9 @@ int main(int argc, char** argv) {
         torch::set_num_interop_threads(1);
     }
 
-    srand(time(NULL));
+    // Every thread's random stream derives from this, log it to replay a run
+    uint64_t seed = seed_streams(options::getUint64("seed", 0));
+    cout << "Random seed: " << seed << endl;
 
     NN model(8, 8, NFEATURES, PSIZE);
 
@@ -50,7 +59,83 @@ int main(int argc, char** argv) {
         }
     }
 
+    // Multi-node selfplay: a learner listens for workers, a worker only
+    // plays games and ships them to the learner
+    string coordinator_listen = options::getStr("coordinator_listen");
+    string coordinator_connect = options::getStr("coordinator_connect");
+
+    unique_ptr<Coordinator> coordinator;
+    unique_ptr<CoordinatorClient> coordinator_client;
+
+    if (coordinator_connect.size())
+        options::setInt("training_threads", 0);
+
+    // Shared inference: one process on the host owns the model and batches
+    // requests from the others, which only run search
+    string inference_listen = options::getStr("inference_server_listen");
+    string inference_connect = options::getStr("inference_server_connect");
+
+    unique_ptr<InferenceServer> inference_server;
+    unique_ptr<InferenceClient> inference_client;
+
+    if (inference_connect.size())
+    {
+        // The local model isn't used for search, it can't be trained here
+        // or reanalyse positions
+        options::setInt("training_threads", 0);
+        options::setInt("reanalysis_threads", 0);
+
+        if (!coordinator_connect.size())
+            cerr << "WARNING: inference_server_connect without coordinator_connect, games stay in the local replay buffer" << endl;
+    }
+
+    if (inference_listen.size())
+    {
+        inference_server.reset(new InferenceServer(
+            &model,
+            inference_listen,
+            options::getInt("inference_server_batch", 256),
+            options::getInt("inference_server_wait_us", 500)
+        ));
+
+        inference_server->start();
+    }
+
     Selfplay s(&model);
+
+    if (inference_connect.size())
+    {
+        cout << "Connecting to inference server at " << inference_connect << endl;
+
+        // Provisional leaves put several evaluations per game in a batch
+        int async_leaves = options::getInt("mcts_async", 0) ? max(1, options::getInt("mcts_async_leaves", 4)) : 1;
+
+        inference_client.reset(new InferenceClient(
+            inference_connect,
+            options::getInt("inference_threads", 1),
+            options::getInt("selfplay_batch", 16) * async_leaves
+        ));
+
+        s.set_inference_client(inference_client.get());
+    }
+
+    if (coordinator_listen.size())
+    {
+        coordinator.reset(new Coordinator(&model, &s.get_rbuf(), coordinator_listen));
+        coordinator->start();
+    }
+
+    if (coordinator_connect.size())
+    {
+        char hostname[256] = "";
+        gethostname(hostname, sizeof(hostname) - 1);
+
+        cout << "Connecting to coordinator at " << coordinator_connect << endl;
+
+        coordinator_client.reset(new CoordinatorClient(coordinator_connect, string(hostname) + ":" + to_string(getpid())));
+        coordinator_client->start_worker(&s, &model, options::getInt("coordinator_sync_ms", 5000));
+    }
+
     s.start();
 
     bool should_quit = false;
@@ -143,9 +228,80 @@ int main(int argc, char** argv) {
 
     commands["status"] = [&](vector<string>& args)
     {
-        cout << "Inference threads: " << options::getInt("inference_threads") << endl;
+        cout << "Inference threads: " << s.get_workers() << " x " << s.get_batch() << " games (" << s.get_parked_games() << " parked)" << endl;
         cout << "Total experiences: " << s.get_rbuf().count() << endl;
+        cout << "Replay records: " << s.get_rbuf().records() << " (" << s.get_rbuf().merges() << " merged duplicates)" << endl;
+
+        if (s.get_rbuf().keeps_history())
+            cout << "Reanalysed targets: " << s.get_rbuf().refreshed() << endl;
         cout << "Current generation: " << model.get_generation() << endl;
+
+        RateScheduler& sched = s.get_scheduler();
+
+        if (sched.enabled())
+        {
+            cout << "Sample reuse: " << sched.get_ratio() << " (target " << sched.get_target() << ", "
+                 << sched.get_consumed() << " consumed / " << sched.get_produced() << " produced)" << endl;
+            cout << "Actor throttle: " << sched.get_actor_wait_ms() / 1000 << "s, learner wait: " << sched.get_learner_wait_ms() / 1000 << "s" << endl;
+        }
+
+        Selfplay::MemoryUsage mem = s.memory_usage();
+        auto mb = [](size_t bytes) { return to_string(bytes / (1024 * 1024)) + " MB"; };
+
+        cout << "Tree nodes: " << mem.tree_nodes << " (" << MCTS::node_bytes << " bytes/node)" << endl;
+        cout << "Tree memory: " << mb(mem.tree_bytes) << endl;
+        cout << "Trajectory memory: " << mb(mem.trajectory_bytes) << endl;
+        cout << "Replay buffer memory: " << mb(mem.replay_bytes) << endl;
+        cout << "Model weights: " << mb(mem.weight_bytes) << endl;
+        cout << "Model activations (est.): " << mb(mem.activation_bytes) << endl;
+
+        if (coordinator)
+            cout << coordinator->report();
+
+        if (coordinator_client)
+            cout << "Coordinator worker id: " << coordinator_client->id() << endl;
+
+        if (inference_server)
+            cout << inference_server->report();
+
+        if (inference_client)
+            cout << "Inference server generation: " << inference_client->get_generation() << endl;
+    };
+
+    // Resize selfplay without stopping, games move between workers
+    commands["workers"] = [&](vector<string>& args)
+    {
+        if (args.size())
+        {
+            int target = stoi(args[0]);
+            int current = s.get_workers();
+
+            if (target > current)
+                s.add_workers(target - current);
+            else if (target < current)
+                s.remove_workers(current - target);
+        }
+
+        cout << "Inference threads: " << s.get_workers() << endl;
+    };
+
+    commands["batch"] = [&](vector<string>& args)
+    {
+        if (args.size())
+            s.set_batch(stoi(args[0]));
+
+        cout << "Selfplay batch: " << s.get_batch() << " games per thread" << endl;
+    };
+
+    commands["stats"] = [&](vector<string>& args)
+    {
+        SearchStats selfplay_stats = s.search_stats();
+        SearchStats eval_stats = s.eval_search_stats();
+
+        cout << "===== Selfplay search =====" << endl << selfplay_stats.report();
+
+        if (eval_stats.searches)
+            cout << "===== Last evaluation search =====" << endl << eval_stats.report();
     };
 
     string line;
@@ -188,5 +344,16 @@ int main(int argc, char** argv) {
 
     s.stop();
 
+    if (coordinator_client)
+        coordinator_client->stop_worker();
+
+    if (coordinator)
+        coordinator->stop();
+
+    inference_client.reset();
+
+    if (inference_server)
+        inference_server->stop();
+
     return 0;
 }
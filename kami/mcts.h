@@ -2,9 +2,13 @@
 
 #include "env.h"
 #include "options.h"
+#include "random.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <random>
+#include <utility>
 #include <vector>
 #include <stdexcept>
 #include <string>
@@ -12,6 +16,17 @@
 #include <iomanip>
 
 namespace kami {
+
+// State of an expanded node, kept out of line so leaves don't pay for it
+struct Expansion {
+    // Progressive widening: actions not yet materialized as children, as
+    // (action, prior) sorted by ascending prior so the best is popped last
+    std::vector<std::pair<int, float>> pending;
+
+    // Network generation which produced the children's priors
+    int generation = 0;
+};
+
 struct Node {
     int n = 0;
     float w = 0.0f;
@@ -20,16 +35,39 @@ struct Node {
     std::vector<Node*> children;
     Node* parent = nullptr;
 
+    // Set once the node is expanded, see MCTS::expansion()
+    Expansion* expansion = nullptr;
+
     float turn;
     float q(float def = 1.0f) { return n > 0 ? w / n : def; }
 
-    void clean()
+    Node() = default;
+    Node(const Node&) = delete;
+    ~Node() { delete expansion; }
+
+    size_t pending_size() const { return expansion ? expansion->pending.size() : 0; }
+    int generation() const { return expansion ? expansion->generation : 0; }
+
+    // Frees all descendants, returns the number of nodes freed. If given,
+    // `freed_pending` accumulates the pending actions released with them and
+    // `freed_expansions` their expansion records.
+    long clean(long* freed_pending = nullptr, long* freed_expansions = nullptr)
     {
+        long freed = children.size();
+
         for (auto& c : children)
         {
-            c->clean();
+            if (freed_pending)
+                *freed_pending += c->pending_size();
+
+            if (freed_expansions)
+                *freed_expansions += c->expansion != nullptr;
+
+            freed += c->clean(freed_pending, freed_expansions);
             delete c;
         }
+
+        return freed;
     }
 
     void backprop(float value)
@@ -63,6 +101,130 @@ struct Node {
     }
 };
 
+/**
+ * Statistics for one search (the simulations between two pushes), or
+ * several merged together.
+ */
+struct SearchStats {
+    static constexpr int MAX_DEPTH = 32;
+
+    long searches = 0;
+    long leaves = 0;            // selections reaching an unexpanded node
+    long terminal_hits = 0;     // selections ending in a terminal position
+    long expansions = 0;
+    long children = 0;          // children created by expansions
+    long reused_nodes = 0;      // nodes kept from the previous search's tree
+    long provisional = 0;       // leaves expanded ahead of their evaluation
+    long rescored = 0;          // expanded nodes re-evaluated by a newer network
+    double correction_total = 0.0; // sum of |NN value - provisional value|
+    long depth_total = 0;
+    int max_depth = 0;
+
+    // Leaf depths, the last bucket collects anything deeper
+    long depth_histogram[MAX_DEPTH] = {};
+
+    // With mcts_timing, nanoseconds spent selecting, observing, expanding and
+    // between a leaf being observed and its expansion (waiting on inference)
+    long select_ns = 0, observe_ns = 0, expand_ns = 0, wait_ns = 0;
+
+    float mean_depth()
+    {
+        long ends = leaves + terminal_hits + rescored;
+        return ends ? (float) depth_total / ends : 0.0f;
+    }
+    float branching() { return expansions ? (float) children / expansions : 0.0f; }
+
+    void merge(SearchStats& other)
+    {
+        searches += other.searches;
+        leaves += other.leaves;
+        terminal_hits += other.terminal_hits;
+        expansions += other.expansions;
+        children += other.children;
+        reused_nodes += other.reused_nodes;
+        provisional += other.provisional;
+        rescored += other.rescored;
+        correction_total += other.correction_total;
+        depth_total += other.depth_total;
+        max_depth = std::max(max_depth, other.max_depth);
+
+        for (int i = 0; i < MAX_DEPTH; ++i)
+            depth_histogram[i] += other.depth_histogram[i];
+
+        select_ns += other.select_ns;
+        observe_ns += other.observe_ns;
+        expand_ns += other.expand_ns;
+        wait_ns += other.wait_ns;
+    }
+
+    std::string report()
+    {
+        std::stringstream out;
+
+        out << "Searches: " << searches << ", leaves: " << leaves << ", terminal hits: " << terminal_hits << std::endl;
+        out << "Expansions: " << expansions << ", branching: " << branching() << std::endl;
+        out << "Reused nodes: " << reused_nodes;
+
+        if (searches)
+            out << " (" << reused_nodes / searches << " per search)";
+
+        out << std::endl;
+        if (provisional)
+            out << "Provisional leaves: " << provisional << ", mean correction: " << correction_total / provisional << std::endl;
+
+        if (rescored)
+            out << "Rescored stale nodes: " << rescored << std::endl;
+
+        out << "Depth: mean " << mean_depth() << ", max " << max_depth << std::endl;
+        out << "Depth histogram:";
+
+        int last = MAX_DEPTH - 1;
+
+        while (last > 0 && !depth_histogram[last])
+            --last;
+
+        for (int i = 0; i <= last; ++i)
+            out << " " << i << (i == MAX_DEPTH - 1 ? "+" : "") << ":" << depth_histogram[i];
+
+        out << std::endl;
+
+        long total_ns = select_ns + observe_ns + expand_ns + wait_ns;
+
+        if (total_ns)
+        {
+            auto pct = [&](long ns) { return std::to_string(100 * ns / total_ns) + "%"; };
+
+            out << "Time: select " << pct(select_ns) << ", observe " << pct(observe_ns)
+                << ", expand " << pct(expand_ns) << ", wait " << pct(wait_ns)
+                << " of " << total_ns / 1000000 << "ms" << std::endl;
+        }
+
+        return out.str();
+    }
+};
+
+/**
+ * Search options fixed at compile time. MCTS has a specialization of its hot
+ * paths (selection, expansion and prior assignment) for every combination,
+ * with the disabled features compiled out, and picks one from the options
+ * when constructed.
+ */
+template <bool ForceExpandUnvisited, bool ScaleCpuct, bool Bootstrap, bool Noise>
+struct MCTSTraits {
+    static constexpr bool force_expand_unvisited = ForceExpandUnvisited;
+    static constexpr bool scale_cpuct = ScaleCpuct;
+    static constexpr bool bootstrap = Bootstrap;
+    static constexpr bool noise = Noise;
+
+    static std::string name()
+    {
+        return std::string("force_expand=") + (force_expand_unvisited ? "1" : "0")
+            + ",scale_cpuct=" + (scale_cpuct ? "1" : "0")
+            + ",bootstrap=" + (bootstrap ? "1" : "0")
+            + ",noise=" + (noise ? "1" : "0");
+    }
+};
+
 class MCTS {
     private:
         Env env;
@@ -77,8 +239,168 @@ class MCTS {
         float noise_weight;
         float noise_alpha;
         int scale_cpuct_by_actions;
+        long nodecount = 1, pendingcount = 0, expansioncount = 0;
+
+        // Top-k expansion: children materialized at expansion, and the
+        // widening schedule max(k, ceil(factor * n^exponent))
+        int expand_topk;
+        float widen_factor, widen_exponent;
+
+        // Lazy re-evaluation: nodes whose priors are older than `generation`
+        // are re-scored when selection passes through them, the root always
+        // and others from `rescore_visits` visits (0 disables)
+        int generation = 0;
+        int rescore_visits;
+
+        // Introspection: the search in progress and the last finished one
+        SearchStats stats, last_stats;
+        bool timing;
+        int depth = 0;
+        std::chrono::steady_clock::time_point leaf_time;
+
+        // Leaves expanded provisionally by select_async(), awaiting resolve()
+        struct InFlight {
+            int ticket;
+            Node* node;
+            float value;        // provisional value backed up through the path
+            float bootstrap;    // static eval at the leaf, scaled by bootstrap_amp
+            bool disable_bootstrap;
+        };
+
+        std::vector<InFlight> inflight;
+        int next_ticket = 0;
+
+        // Noise and move picks, seeded per game from the thread's stream
+        Random rng;
+
+        // A specialization of the hot paths, see MCTSTraits
+        struct Variant {
+            std::string name;
+            bool (MCTS::*descend)(float*);
+            void (MCTS::*expand)(float*, float, bool);
+            std::vector<float> (MCTS::*assign_priors)(std::vector<int>&, float*);
+        };
+
+        const Variant* variant;
+
+        template <class Traits>
+        static Variant make_variant()
+        {
+            return { Traits::name(), &MCTS::descend_t<Traits>, &MCTS::expand_t<Traits>, &MCTS::assign_priors_t<Traits> };
+        }
+
+        template <int... I>
+        static std::vector<Variant> make_variants(std::integer_sequence<int, I...>)
+        {
+            return { make_variant<MCTSTraits<(I & 1) != 0, (I & 2) != 0, (I & 4) != 0, (I & 8) != 0>>()... };
+        }
+
+        // Every specialization, indexed by the traits as bits
+        static const std::vector<Variant>& variants()
+        {
+            static const std::vector<Variant> table = make_variants(std::make_integer_sequence<int, 16>());
+            return table;
+        }
+
+        // Turn a pending action of `node` into a child, `pa` is consumed
+        void materialize(Node* node, std::pair<int, float>& pa)
+        {
+            Node* child = new Node();
+
+            child->action = pa.first;
+            child->parent = node;
+            child->turn = -node->turn;
+            child->p = pa.second;
+
+            std::vector<std::pair<int, float>>& pending = node->expansion->pending;
+
+            node->children.push_back(child);
+            pending.erase(pending.begin() + (&pa - &pending[0]));
+
+            ++nodecount;
+            --pendingcount;
+        }
+
+        void record_leaf()
+        {
+            stats.depth_total += depth;
+            stats.max_depth = std::max(stats.max_depth, depth);
+            ++stats.depth_histogram[std::min(depth, SearchStats::MAX_DEPTH - 1)];
+        }
+
+        void observe(float* obs)
+        {
+            if (timing)
+            {
+                auto start = std::chrono::steady_clock::now();
+                env.observe(obs);
+                stats.observe_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            }
+            else
+                env.observe(obs);
+        }
+
+        // Re-assigns the priors of an expanded node's children and pending
+        // actions from `policy`, keeping their visits. Under top-k expansion
+        // the materialized children are chosen again from the new priors:
+        // children with visits (or subtrees) stay, the rest compete with the
+        // pending actions for the widening limit.
+        void rescore(Node* node, float* policy)
+        {
+            std::vector<std::pair<int, float>>& pending = expansion(node).pending;
+            std::vector<int> actions;
+
+            for (auto& c : node->children)
+                actions.push_back(c->action);
+
+            for (auto& pa : pending)
+                actions.push_back(pa.first);
+
+            std::vector<float> priors = assign_priors(actions, policy);
+
+            int nchildren = node->children.size();
 
-        std::mt19937 rng;
+            for (int i = 0; i < nchildren; ++i)
+                node->children[i]->p = priors[i];
+
+            for (int i = 0; i < pending.size(); ++i)
+                pending[i].second = priors[nchildren + i];
+
+            // Only nodes expanded with top-k have pending actions
+            bool reselect = expand_topk > 0 && pending.size();
+
+            if (reselect)
+            {
+                std::vector<Node*> kept;
+
+                for (auto& c : node->children)
+                {
+                    if (c->n || c->children.size() || c->pending_size())
+                    {
+                        kept.push_back(c);
+                        continue;
+                    }
+
+                    pending.push_back({ c->action, c->p });
+                    expansioncount -= c->expansion != nullptr;
+                    delete c;
+
+                    --nodecount;
+                    ++pendingcount;
+                }
+
+                node->children.swap(kept);
+            }
+
+            std::sort(pending.begin(), pending.end(), [](const std::pair<int, float>& lhs, const std::pair<int, float>& rhs) {
+                return lhs.second < rhs.second;
+            });
+
+            if (reselect)
+                widen(node, widen_limit(node->n));
+
+            node->expansion->generation = generation;
+        }
 
     public:
         Node* root = nullptr;
@@ -95,8 +417,21 @@ class MCTS {
             scale_cpuct_by_actions = options::getInt("scale_cpuct_by_actions", 0);
             noise_alpha = options::getFloat("mcts_noise_alpha", 0.05f);
             noise_weight = options::getFloat("mcts_noise_weight", 0.05f);
-
-            rng.seed(time(NULL));
+            expand_topk = options::getInt("mcts_expand_topk", 0);
+            widen_factor = options::getFloat("mcts_widen_factor", 1.0f);
+            widen_exponent = options::getFloat("mcts_widen_exponent", 0.5f);
+            rescore_visits = options::getInt("mcts_rescore_visits", 0);
+            timing = options::getInt("mcts_timing", 0);
+            stats.searches = 1;
+
+            variant = &variants()[
+                (force_expand_unvisited ? 1 : 0)
+                | (scale_cpuct_by_actions ? 2 : 0)
+                | (bootstrap_weight > 0.0f ? 4 : 0)
+                | (noise_weight > 0.0f ? 8 : 0)
+            ];
+
+            rng.reseed(thread_rng()());
         }
 
         ~MCTS()
@@ -110,8 +445,32 @@ class MCTS {
 
         int n() { return root->n; }
 
+        /**
+         * Each game's seed is drawn when it starts, by the constructor or
+         * reset(), and get_seed() returns it until the next reset(). To replay
+         * a game, reset() the tree and then seed() it with that value.
+         */
+        void seed(uint64_t s) { rng.reseed(s); }
+        uint64_t get_seed() { return rng.seed(); }
+
         void push(int action)
         {
+            if (inflight.size())
+                throw std::runtime_error("push() with evaluations in flight, resolve them first");
+
+            // The action may not have been materialized yet
+            if (root->expansion)
+            {
+                for (auto& pa : root->expansion->pending)
+                {
+                    if (pa.first == action)
+                    {
+                        materialize(root, pa);
+                        break;
+                    }
+                }
+            }
+
             Node* next = nullptr;
 
             for (auto& c : root->children)
@@ -120,7 +479,12 @@ class MCTS {
                     next = c;
                 else
                 {
-                    c->clean();
+                    long freed_pending = c->pending_size();
+                    long freed_expansions = c->expansion != nullptr;
+
+                    nodecount -= c->clean(&freed_pending, &freed_expansions) + 1;
+                    pendingcount -= freed_pending;
+                    expansioncount -= freed_expansions;
                     delete c;
                 }
             }
@@ -128,10 +492,22 @@ class MCTS {
             if (!next)
                 throw std::runtime_error("no child for action");
 
+            pendingcount -= root->pending_size();
+            expansioncount -= root->expansion != nullptr;
+            --nodecount;
             delete root;
             root = next;
             root->parent = nullptr;
             env.push(action);
+
+            last_stats = stats;
+            stats = SearchStats();
+            stats.searches = 1;
+            stats.reused_nodes = nodecount;
+
+            // Root noise can lift any action, keep the root exact
+            if (noise_weight > 0.0f)
+                widen(root, root->children.size() + root->pending_size());
         }
 
         int pick(float alpha = 0.0f) {
@@ -170,7 +546,7 @@ class MCTS {
             for (auto& d : dist)
                 d /= length;
 
-            double ind = (double) rand() / (double) RAND_MAX;
+            double ind = rng.uniform();
 
             for (unsigned i = 0; i < root->children.size(); ++i)
             {
@@ -184,9 +560,34 @@ class MCTS {
         }
 
         bool select(float* obs)
+        {
+            if (!timing)
+                return descend(obs);
+
+            auto start = std::chrono::steady_clock::now();
+            long observe_before = stats.observe_ns;
+
+            bool ready = descend(obs);
+
+            auto end = std::chrono::steady_clock::now();
+            stats.select_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() - (stats.observe_ns - observe_before);
+
+            if (ready)
+                leaf_time = end;
+
+            return ready;
+        }
+
+        bool descend(float* obs) { return (this->*variant->descend)(obs); }
+
+        template <class Traits>
+        bool descend_t(float* obs)
         {
             if (!target)
+            {
                 target = root;
+                depth = 0;
+            }
 
             // If no children, need to expand
             if (target->children.empty())
@@ -195,6 +596,9 @@ class MCTS {
                 float value;
                 if (env.terminal(&value))
                 {
+                    record_leaf();
+                    ++stats.terminal_hits;
+
                     target->backprop(value);
 
                     while (target != root)
@@ -207,27 +611,49 @@ class MCTS {
                     return false;
                 }
 
-                env.observe(obs);
+                record_leaf();
+                ++stats.leaves;
+
+                observe(obs);
                 return true;
             }
 
+            // Priors from an older network: stop here for an evaluation, and
+            // expand() re-scores the children instead of creating them
+            if (rescore_visits > 0 && target->generation() < generation && (target == root || target->n >= rescore_visits))
+            {
+                record_leaf();
+                ++stats.rescored;
+
+                observe(obs);
+                return true;
+            }
+
+            // Unlock more children as the node gathers visits
+            if (target->pending_size())
+                widen(target, widen_limit(target->n));
+
             // Iterate children
             double best_uct = -1000.0;
             Node* best_child = nullptr;
 
             float cpuct = cPUCT;
 
-            if (scale_cpuct_by_actions)
-                cpuct /= (float) target->children.size();
+            if constexpr (Traits::scale_cpuct)
+                cpuct /= (float) (target->children.size() + target->pending_size());
 
             for (auto& c : target->children)
             {
                 // Force expanding unvisisted children
-                if (force_expand_unvisited && !c->n)
+                if constexpr (Traits::force_expand_unvisited)
                 {
-                    target = c;
-                    env.push(c->action);
-                    return select(obs);
+                    if (!c->n)
+                    {
+                        target = c;
+                        env.push(c->action);
+                        ++depth;
+                        return descend_t<Traits>(obs);
+                    }
                 }
 
                 double uct = c->q(unvisited_node_value * c->turn) + c->p * cpuct * sqrt(target->n) / (double) (c->n + 1);
@@ -251,11 +677,26 @@ class MCTS {
 
             env.push(best_child->action);
             target = best_child;
-            return select(obs);
+            ++depth;
+            return descend_t<Traits>(obs);
         }
 
         void expand(float* policy, float value, bool disable_bootstrap=false)
         {
+            (this->*variant->expand)(policy, value, disable_bootstrap);
+        }
+
+        template <class Traits>
+        void expand_t(float* policy, float value, bool disable_bootstrap)
+        {
+            std::chrono::steady_clock::time_point start;
+
+            if (timing)
+            {
+                start = std::chrono::steady_clock::now();
+                stats.wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(start - leaf_time).count();
+            }
+
             std::vector<int> actions = env.actions();
 
             #ifndef NDEBUG
@@ -270,40 +711,59 @@ class MCTS {
                 throw std::runtime_error("softmax sums to " + std::to_string(tsum));
             #endif
 
-            float ptotal = 0.0f;
+            // Already expanded by an older network, only the priors change
+            if (target->children.size() || target->pending_size())
+                rescore(target, policy);
+            else
+            {
+                std::vector<float> priors = assign_priors_t<Traits>(actions, policy);
+                Expansion& exp = expansion(target);
 
-            for (int action : actions)
-                ptotal += policy[action];
+                // Keep every child at the root when it's noised, otherwise only
+                // the top k by prior; the rest wait in the pending list
+                int materialized = actions.size();
 
-            // Generate noise for each action
-            std::vector<float> noise(actions.size(), 0.0f);
-            float total_noise = 0.0f;
+                if (expand_topk > 0 && !(Traits::noise && target == root))
+                    materialized = std::min(materialized, widen_limit(target->n));
 
-            for (int i = 0; i < noise.size(); ++i)
-            {
-                std::gamma_distribution<> dist(1.0f, 1.0f);
-                noise[i] = dist(rng);
-                total_noise += noise[i];
-            }
+                std::vector<std::pair<int, float>> order;
 
-            for (int i = 0; i < actions.size(); ++i)
-            {
-                Node* new_child = new Node();
+                for (int i = 0; i < actions.size(); ++i)
+                    order.push_back({ actions[i], priors[i] });
 
-                new_child->action = actions[i];
-                new_child->parent = target;
-                new_child->turn = -target->turn;
-                new_child->p = (1 - noise_weight) * policy[actions[i]] / ptotal + noise_weight * (noise[i] / total_noise);
+                if (materialized < actions.size())
+                {
+                    std::sort(order.begin(), order.end(), [](const std::pair<int, float>& lhs, const std::pair<int, float>& rhs) {
+                        return lhs.second > rhs.second;
+                    });
+                }
 
-                #ifndef NDEBUG
-                    if (policy[actions[i]] < 0.0f)
-                        throw std::runtime_error("negative policy detected: " + std::to_string(policy[actions[i]]));
+                for (int i = 0; i < order.size(); ++i)
+                {
+                    if (i < materialized)
+                    {
+                        Node* new_child = new Node();
 
-                    if (std::isnan(policy[actions[i]]))
-                        throw std::runtime_error("NaN policy detected");
-                #endif
+                        new_child->action = order[i].first;
+                        new_child->parent = target;
+                        new_child->turn = -target->turn;
+                        new_child->p = order[i].second;
 
-                target->children.push_back(new_child);
+                        target->children.push_back(new_child);
+                    }
+                    else
+                        exp.pending.push_back(order[i]);
+                }
+
+                std::reverse(exp.pending.begin(), exp.pending.end());
+
+                nodecount += materialized;
+                pendingcount += actions.size() - materialized;
+
+                ++stats.expansions;
+                stats.children += materialized;
+
+                exp.generation = generation;
             }
 
             // The NN outputs a value relative to this action. We are looking
@@ -312,8 +772,11 @@ class MCTS {
 
             value *= target->turn;
 
-            if (!disable_bootstrap && bootstrap_weight > 0.0f)
-                value = (1 - bootstrap_weight) * value + bootstrap_weight * env.bootstrap_value(bootstrap_window) * bootstrap_amp;
+            if constexpr (Traits::bootstrap)
+            {
+                if (!disable_bootstrap)
+                    value = (1 - bootstrap_weight) * value + bootstrap_weight * env.bootstrap_value(bootstrap_window) * bootstrap_amp;
+            }
 
             target->backprop(value);
 
@@ -324,10 +787,205 @@ class MCTS {
             }
 
             target = nullptr;
+
+            if (timing)
+                stats.expand_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        /**
+         * Asynchronous simulation. Like select(), but a leaf needing an
+         * evaluation is expanded at once with uniform priors and backed up
+         * with a provisional value from the static eval, so the search can go
+         * on while `obs` is being inferred. Returns a ticket for resolve(), or
+         * -1 if the simulation needed no evaluation.
+         *
+         * Provisional leaves always get every child; top-k expansion only
+         * applies to expand().
+         */
+        int select_async(float* obs, bool disable_bootstrap=false)
+        {
+            if (!select(obs))
+                return -1;
+
+            // A stale node keeps its old priors until resolve()
+            if (target->children.empty())
+            {
+                std::vector<int> actions = env.actions();
+                std::vector<float> priors = assign_priors(actions, nullptr);
+
+                for (int i = 0; i < actions.size(); ++i)
+                {
+                    Node* child = new Node();
+
+                    child->action = actions[i];
+                    child->parent = target;
+                    child->turn = -target->turn;
+                    child->p = priors[i];
+
+                    target->children.push_back(child);
+                }
+
+                nodecount += actions.size();
+
+                ++stats.expansions;
+                stats.children += actions.size();
+            }
+
+            // Not stale again before resolve()
+            expansion(target).generation = generation;
+            ++stats.provisional;
+
+            InFlight leaf;
+
+            leaf.ticket = next_ticket++;
+            leaf.node = target;
+            leaf.bootstrap = env.bootstrap_value(bootstrap_window) * bootstrap_amp;
+            leaf.value = leaf.bootstrap;
+            leaf.disable_bootstrap = disable_bootstrap;
+
+            inflight.push_back(leaf);
+            target->backprop(leaf.value);
+
+            while (target != root)
+            {
+                env.pop();
+                target = target->parent;
+            }
+
+            target = nullptr;
+            return leaf.ticket;
+        }
+
+        /**
+         * Applies the network's output to a provisional leaf: its children
+         * get the real priors, and the difference between the real and the
+         * provisional value is added along the path to the root. Tickets from
+         * before the last reset() are ignored.
+         */
+        void resolve(int ticket, float* policy, float value)
+        {
+            auto it = std::find_if(inflight.begin(), inflight.end(), [&](InFlight& f) { return f.ticket == ticket; });
+
+            if (it == inflight.end())
+                return;
+
+            Node* leaf = it->node;
+
+            // Same value as expand() would have backed up
+            value *= leaf->turn;
+
+            if (!it->disable_bootstrap && bootstrap_weight > 0.0f)
+                value = (1 - bootstrap_weight) * value + bootstrap_weight * it->bootstrap;
+
+            float correction = value - it->value;
+
+            for (Node* n = leaf; n; n = n->parent)
+                n->w += correction * n->turn / 2.0f;
+
+            rescore(leaf, policy);
+
+            stats.correction_total += fabs(correction);
+            inflight.erase(it);
+        }
+
+        // Provisional leaves awaiting resolve()
+        int in_flight() { return inflight.size(); }
+
+        /**
+         * Child priors for `actions`: the policy renormalized over legal
+         * actions and mixed with noise. A null policy is uniform.
+         */
+        std::vector<float> assign_priors(std::vector<int>& actions, float* policy)
+        {
+            return (this->*variant->assign_priors)(actions, policy);
+        }
+
+        template <class Traits>
+        std::vector<float> assign_priors_t(std::vector<int>& actions, float* policy)
+        {
+            float ptotal = 0.0f;
+
+            for (int action : actions)
+            {
+                #ifndef NDEBUG
+                    if (policy && policy[action] < 0.0f)
+                        throw std::runtime_error("negative policy detected: " + std::to_string(policy[action]));
+
+                    if (policy && std::isnan(policy[action]))
+                        throw std::runtime_error("NaN policy detected");
+                #endif
+
+                ptotal += policy ? policy[action] : 1.0f;
+            }
+
+            std::vector<float> priors(actions.size());
+
+            if constexpr (!Traits::noise)
+            {
+                for (int i = 0; i < actions.size(); ++i)
+                    priors[i] = (policy ? policy[actions[i]] : 1.0f) / ptotal;
+
+                return priors;
+            }
+
+            // Generate noise for each action
+            std::vector<float> noise(actions.size(), 0.0f);
+            float total_noise = 0.0f;
+
+            for (int i = 0; i < noise.size(); ++i)
+            {
+                std::gamma_distribution<> dist(1.0f, 1.0f);
+                noise[i] = dist(rng);
+                total_noise += noise[i];
+            }
+
+            for (int i = 0; i < actions.size(); ++i)
+                priors[i] = (1 - noise_weight) * (policy ? policy[actions[i]] : 1.0f) / ptotal + noise_weight * (noise[i] / total_noise);
+
+            return priors;
+        }
+
+        // A node's expansion record, created on first use
+        Expansion& expansion(Node* node)
+        {
+            if (!node->expansion)
+            {
+                node->expansion = new Expansion();
+                ++expansioncount;
+            }
+
+            return *node->expansion;
+        }
+
+        // Children a node with `visits` may have under top-k expansion
+        int widen_limit(int visits)
+        {
+            if (expand_topk <= 0)
+                return PSIZE;
+
+            return std::max(expand_topk, (int) ceil(widen_factor * pow(visits, widen_exponent)));
+        }
+
+        // Materialize pending actions of `node`, best prior first, until it
+        // has `limit` children
+        void widen(Node* node, int limit)
+        {
+            while (node->pending_size() && node->children.size() < limit)
+                materialize(node, node->expansion->pending.back());
         }
 
         Env& get_env() { return env; }
 
+        // Specialization picked from the options, see MCTSTraits
+        const std::string& variant_name() { return variant->name; }
+
+        /**
+         * Sets the generation of the network evaluating this tree's leaves.
+         * With mcts_rescore_visits, nodes expanded by an older generation are
+         * re-scored as selection reaches them.
+         */
+        void set_generation(int g) { generation = g; }
+
         void reset() {
             env = Env();
             target = nullptr;
@@ -336,8 +994,113 @@ class MCTS {
             delete root;
             root = new Node();
             root->turn = -env.turn();
+            nodecount = 1;
+            pendingcount = 0;
+            expansioncount = 0;
+
+            // Outstanding tickets are ignored by resolve() from here
+            inflight.clear();
+
+            // A new game, with a new seed
+            rng.reseed(thread_rng()());
+
+            last_stats = stats;
+            stats = SearchStats();
+            stats.searches = 1;
+        }
+
+        // Starts a new search from the position after `moves`
+        void reset(const std::vector<int>& moves)
+        {
+            reset();
+
+            for (int action : moves)
+                env.push(action);
+
+            root->turn = -env.turn();
+        }
+
+        long nodes() { return nodecount; }
+
+        // Actions held unexpanded by top-k expansion
+        long pending() { return pendingcount; }
+
+        // Statistics of the search in progress, and of the search finished
+        // by the last push() or reset()
+        SearchStats& search_stats() { return stats; }
+        SearchStats& last_search_stats() { return last_stats; }
+
+        /**
+         * Principal variation: the most visited line from the root, up to
+         * `max_length` actions. Only valid between simulations.
+         */
+        std::string pv(int max_length = 16)
+        {
+            if (target)
+                throw std::runtime_error("pv() called during a simulation");
+
+            std::stringstream out;
+            Node* node = root;
+            int pushed = 0;
+
+            while (node->children.size() && pushed < max_length)
+            {
+                Node* best = nullptr;
+
+                for (auto& c : node->children)
+                    if (!best || c->n > best->n)
+                        best = c;
+
+                if (!best->n)
+                    break;
+
+                out << (pushed ? " " : "") << env.debug_action(best->action);
+                env.push(best->action);
+                ++pushed;
+                node = best;
+            }
+
+            for (int i = 0; i < pushed; ++i)
+                env.pop();
+
+            return out.str();
+        }
+
+        // Root children by visit count, one per line
+        std::string dump()
+        {
+            if (target)
+                throw std::runtime_error("dump() called during a simulation");
+
+            std::vector<Node*> children = root->children;
+
+            std::sort(children.begin(), children.end(), [](Node* lhs, Node* rhs) { return lhs->n > rhs->n; });
+
+            std::stringstream out;
+
+            for (auto& c : children)
+                out << c->debug(&env) << "\n";
+
+            if (root->pending_size())
+                out << root->pending_size() << " actions pending expansion\n";
+
+            return out.str();
         }
 
+        // Approximate heap footprint of a node: the node itself and its
+        // pointer in the parent's child list
+        static constexpr size_t node_bytes = sizeof(Node) + sizeof(Node*);
+        static constexpr size_t pending_bytes = sizeof(std::pair<int, float>);
+        static constexpr size_t expansion_bytes = sizeof(Expansion);
+
+        size_t bytes()
+        {
+            return sizeof(MCTS) - sizeof(Env) + env.bytes() + nodecount * node_bytes + expansioncount * expansion_bytes + pendingcount * pending_bytes;
+        }
+
+        // Nodes which have been expanded and hold an expansion record
+        long expansions() { return expansioncount; }
+
         void snapshot(float* pspace)
         {
             for (int i = 0; i < PSIZE; ++i)
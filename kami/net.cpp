@@ -0,0 +1,262 @@
+#include "net.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace kami;
+using namespace std;
+
+static bool is_unix(string& addr)
+{
+    return addr.rfind("unix:", 0) == 0;
+}
+
+static sockaddr_un unix_addr(string addr)
+{
+    sockaddr_un sa;
+    string path = addr.substr(5);
+
+    if (path.size() >= sizeof(sa.sun_path))
+        throw runtime_error("unix socket path too long: " + path);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path.c_str());
+
+    return sa;
+}
+
+static addrinfo* tcp_addr(string addr, bool passive)
+{
+    if (addr.rfind("tcp:", 0) == 0)
+        addr = addr.substr(4);
+
+    size_t colon = addr.rfind(':');
+
+    if (colon == string::npos)
+        throw runtime_error("expected host:port in address \"" + addr + "\"");
+
+    string host = addr.substr(0, colon);
+    string port = addr.substr(colon + 1);
+
+    addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    int err = getaddrinfo(host.size() ? host.c_str() : nullptr, port.c_str(), &hints, &res);
+
+    if (err)
+        throw runtime_error("couldn't resolve " + addr + ": " + gai_strerror(err));
+
+    return res;
+}
+
+int net::listen(string addr)
+{
+    int fd;
+
+    if (is_unix(addr))
+    {
+        sockaddr_un sa = unix_addr(addr);
+
+        // Remove a stale socket left by a previous run
+        ::unlink(sa.sun_path);
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            throw runtime_error(string("socket() failed: ") + strerror(errno));
+
+        if (bind(fd, (sockaddr*) &sa, sizeof(sa)) < 0)
+        {
+            ::close(fd);
+            throw runtime_error("couldn't bind " + addr + ": " + strerror(errno));
+        }
+    }
+    else
+    {
+        addrinfo* res = tcp_addr(addr, true);
+
+        if ((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0)
+        {
+            freeaddrinfo(res);
+            throw runtime_error(string("socket() failed: ") + strerror(errno));
+        }
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(fd, res->ai_addr, res->ai_addrlen) < 0)
+        {
+            freeaddrinfo(res);
+            ::close(fd);
+            throw runtime_error("couldn't bind " + addr + ": " + strerror(errno));
+        }
+
+        freeaddrinfo(res);
+    }
+
+    if (::listen(fd, 64) < 0)
+    {
+        ::close(fd);
+        throw runtime_error("couldn't listen on " + addr + ": " + strerror(errno));
+    }
+
+    return fd;
+}
+
+int net::connect(string addr)
+{
+    int fd;
+
+    if (is_unix(addr))
+    {
+        sockaddr_un sa = unix_addr(addr);
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            throw runtime_error(string("socket() failed: ") + strerror(errno));
+
+        if (::connect(fd, (sockaddr*) &sa, sizeof(sa)) < 0)
+        {
+            ::close(fd);
+            throw runtime_error("couldn't connect to " + addr + ": " + strerror(errno));
+        }
+
+        return fd;
+    }
+
+    addrinfo* res = tcp_addr(addr, false);
+
+    if ((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0)
+    {
+        freeaddrinfo(res);
+        throw runtime_error(string("socket() failed: ") + strerror(errno));
+    }
+
+    if (::connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+    {
+        freeaddrinfo(res);
+        ::close(fd);
+        throw runtime_error("couldn't connect to " + addr + ": " + strerror(errno));
+    }
+
+    freeaddrinfo(res);
+
+    // Messages are small and request/response, don't wait to coalesce
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return fd;
+}
+
+int net::accept(int fd)
+{
+    int conn = ::accept(fd, nullptr, nullptr);
+
+    if (conn < 0)
+        throw runtime_error(string("accept() failed: ") + strerror(errno));
+
+    return conn;
+}
+
+void net::close(int fd)
+{
+    ::close(fd);
+}
+
+void net::shutdown(int fd)
+{
+    ::shutdown(fd, SHUT_RDWR);
+}
+
+void net::unlink(string addr)
+{
+    if (is_unix(addr))
+        ::unlink(addr.substr(5).c_str());
+}
+
+void net::send_all(int fd, const void* data, size_t len)
+{
+    const char* src = (const char*) data;
+
+    while (len)
+    {
+        ssize_t n = ::send(fd, src, len, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            throw runtime_error(string("send failed: ") + strerror(errno));
+
+        src += n;
+        len -= n;
+    }
+}
+
+void net::recv_all(int fd, void* data, size_t len)
+{
+    char* dst = (char*) data;
+
+    while (len)
+    {
+        ssize_t n = ::recv(fd, dst, len, 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (!n)
+            throw runtime_error("connection closed");
+
+        if (n < 0)
+            throw runtime_error(string("recv failed: ") + strerror(errno));
+
+        dst += n;
+        len -= n;
+    }
+}
+
+void net::send_msg(int fd, uint32_t type, const void* payload, uint32_t len)
+{
+    uint32_t header[2] = { type, len };
+
+    send_all(fd, header, sizeof(header));
+
+    if (len)
+        send_all(fd, payload, len);
+}
+
+uint32_t net::recv_msg(int fd, vector<char>& payload, uint32_t max_len)
+{
+    uint32_t header[2];
+
+    recv_all(fd, header, sizeof(header));
+
+    if (header[1] > max_len)
+        throw runtime_error("message of " + to_string(header[1]) + " bytes exceeds limit of " + to_string(max_len));
+
+    payload.resize(header[1]);
+
+    if (header[1])
+        recv_all(fd, &payload[0], header[1]);
+
+    return header[0];
+}
+
+void net::Reader::get(void* dst, size_t len)
+{
+    if (pos + len > buf.size())
+        throw runtime_error("truncated message");
+
+    memcpy(dst, &buf[pos], len);
+    pos += len;
+}
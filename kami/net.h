@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Socket helpers shared by the coordinator and the inference server.
+ *
+ * Addresses are "unix:/path/to/socket" or "tcp:host:port" (a bare
+ * "host:port" is also taken as TCP). Messages are framed as a 32-bit type
+ * and a 32-bit payload length in host byte order, followed by the payload;
+ * peers are expected to share an architecture.
+ */
+
+namespace kami::net {
+    int listen(std::string addr);
+    int connect(std::string addr);
+    int accept(int fd);
+    void close(int fd);
+
+    // Unblocks any thread waiting on the socket
+    void shutdown(int fd);
+
+    // Release a listening socket's filesystem entry if it has one
+    void unlink(std::string addr);
+
+    void send_all(int fd, const void* data, size_t len);
+    void recv_all(int fd, void* data, size_t len);
+
+    // Largest payload recv_msg() accepts by default, far above any model or
+    // upload chunk but bounding what a bad peer can make us allocate
+    constexpr uint32_t MAX_PAYLOAD = 256 << 20;
+
+    void send_msg(int fd, uint32_t type, const void* payload = nullptr, uint32_t len = 0);
+    uint32_t recv_msg(int fd, std::vector<char>& payload, uint32_t max_len = MAX_PAYLOAD);
+
+    // Sequential reads and writes of message payloads
+    class Writer {
+        public:
+            template <typename T>
+            void put(T value) { put(&value, sizeof(T)); }
+
+            void put(const void* data, size_t len)
+            {
+                const char* src = (const char*) data;
+                buf.insert(buf.end(), src, src + len);
+            }
+
+            std::vector<char> buf;
+    };
+
+    class Reader {
+        public:
+            Reader(std::vector<char>& buf) : buf(buf) {}
+
+            template <typename T>
+            T get() { T value; get(&value, sizeof(T)); return value; }
+
+            void get(void* dst, size_t len);
+            size_t remaining() { return buf.size() - pos; }
+
+        private:
+            std::vector<char>& buf;
+            size_t pos = 0;
+    };
+}
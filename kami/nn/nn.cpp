@@ -1,5 +1,6 @@
 #include "nn.h"
 #include "../options.h"
+#include "../random.h"
 
 #include <memory>
 #include <random>
@@ -39,7 +40,7 @@ NNModule::NNModule(int width, int height, int features, int psize) :
     features(features),
     psize(psize)
 {
-    int filters = options::getInt("filters", 256);
+    filters = options::getInt("filters", 256);
     int nresiduals = options::getInt("residuals", 2);
 
     batchnorm = register_module("batchnorm1", BatchNorm2d(filters));
@@ -92,16 +93,32 @@ vector<Tensor> NNModule::forward(Tensor x)
 
 Tensor NNModule::loss(Tensor& p, Tensor& v, Tensor& obsp, Tensor& obsv)
 {
-    // Value loss: MSE
-    Tensor value_loss = mse_loss(v, obsv).sum();
+    return policy_loss(p, obsp).add(value_loss(v, obsv));
+}
+
+Tensor NNModule::policy_loss(Tensor& p, Tensor& obsp)
+{
+    return sample_policy_loss(p, obsp).sum();
+}
 
+Tensor NNModule::value_loss(Tensor& v, Tensor& obsv)
+{
+    return sample_value_loss(v, obsv).mean();
+}
+
+Tensor NNModule::sample_policy_loss(Tensor& p, Tensor& obsp)
+{
     // Policy loss -(obsp . log(p)) [maximize directional similarity to p-obsp]
-    Tensor policy_loss = obsp
+    return obsp
         .mul(torch::log(p + 0.001))
-        .sum()
+        .sum(1)
         .neg();
+}
 
-    return policy_loss.add(value_loss);
+Tensor NNModule::sample_value_loss(Tensor& v, Tensor& obsv)
+{
+    // Value loss: MSE
+    return (v - obsv).pow(2).mean(1);
 }
 
 NN::NN(int width, int height, int features, int psize, bool force_cpu) :
@@ -186,6 +203,116 @@ void NN::infer(float* input, int batch, float* policy, float* value)
     memcpy(value, value_data, batch * sizeof(float));
 }
 
+void NN::validate(int trajectories, float* inputs, float* obs_p, float* obs_v, float* policy_loss, float* value_loss)
+{
+    mut.lock_shared();
+    validate_locked(trajectories, inputs, obs_p, obs_v, policy_loss, value_loss);
+    mut.unlock_shared();
+}
+
+void NN::validate_locked(int trajectories, float* inputs, float* obs_p, float* obs_v, float* policy_loss, float* value_loss)
+{
+    // Validation sets can be large, evaluate in fixed-size chunks
+    const int chunk = 128;
+
+    double ptotal = 0.0, vtotal = 0.0;
+
+    for (int base = 0; base < trajectories; base += chunk)
+    {
+        int n = min(chunk, trajectories - base);
+
+        Tensor tinputs = torch::from_blob(inputs + base * width * height * features, { n, width, height, features }, kCPU).to(device, kFloat32);
+        Tensor tobsp = torch::from_blob(obs_p + base * psize, { n, psize }, kCPU).to(device, kFloat32);
+        Tensor tobsv = torch::from_blob(obs_v + base, { n, 1 }, kCPU).to(device, kFloat32);
+
+        torch::NoGradGuard guard;
+        vector<Tensor> outputs = mod->forward(tinputs);
+
+        // Policy loss is summed over the batch, value loss is already a mean
+        ptotal += mod->policy_loss(outputs[0], tobsp).cpu().item<float>();
+        vtotal += mod->value_loss(outputs[1], tobsv).cpu().item<float>() * n;
+    }
+
+    *policy_loss = ptotal / trajectories;
+    *value_loss = vtotal / trajectories;
+}
+
+vector<Tensor> NN::snapshot()
+{
+    vector<Tensor> state;
+
+    for (auto& p : mod->parameters())
+        state.push_back(p.detach().clone());
+
+    for (auto& b : mod->buffers())
+        state.push_back(b.detach().clone());
+
+    return state;
+}
+
+void NN::restore(vector<Tensor>& state)
+{
+    torch::NoGradGuard guard;
+    int i = 0;
+
+    for (auto& p : mod->parameters())
+        p.copy_(state[i++]);
+
+    for (auto& b : mod->buffers())
+        b.copy_(state[i++]);
+}
+
+long NN::parameter_count()
+{
+    long total = 0;
+
+    mut.lock_shared();
+
+    for (auto& p : mod->parameters())
+        total += p.numel();
+
+    mut.unlock_shared();
+
+    return total;
+}
+
+size_t NN::weight_bytes()
+{
+    size_t total = 0;
+
+    mut.lock_shared();
+
+    for (auto& p : mod->parameters())
+        total += p.numel() * p.element_size();
+
+    for (auto& b : mod->buffers())
+        total += b.numel() * b.element_size();
+
+    mut.unlock_shared();
+
+    return total;
+}
+
+size_t NN::activation_bytes(int batch)
+{
+    size_t squares = width * height;
+    size_t filters = mod->get_filters();
+
+    // input, initial conv + batchnorm + relu
+    size_t floats = squares * features + 3 * squares * filters;
+
+    // conv + batchnorm + relu twice and the skip sum per residual
+    floats += mod->get_residuals() * 7 * squares * filters;
+
+    // policy head: conv + batchnorm + relu, conv, softmax outputs
+    floats += 3 * squares * 128 + squares * 73 + 2 * psize;
+
+    // value head: conv + batchnorm + relu, fc, tanh
+    floats += 3 * squares + 2 * 256;
+
+    return floats * sizeof(float) * batch;
+}
+
 void NN::write(string path)
 {
     mut.lock_shared();
@@ -221,10 +348,76 @@ void NN::read(string path)
     }
 }
 
-void NN::train(int trajectories, float* inputs, float* obs_p, float* obs_v, bool detect_anomaly)
+void NN::write(ostream& out)
+{
+    mut.lock_shared();
+
+    serialize::OutputArchive a;
+    mod->save(a);
+
+    a.write("generation", IValue(generation));
+
+    a.save_to(out);
+    mut.unlock_shared();
+}
+
+void NN::read(istream& in)
+{
+    mut.lock();
+    try {
+        serialize::InputArchive i;
+        i.load_from(in, device);
+
+        IValue genvalue;
+        i.read("generation", genvalue);
+
+        generation = genvalue.toInt();
+
+        mod->load(i);
+        mut.unlock();
+    } catch (exception& e) {
+        mut.unlock();
+        throw;
+    }
+}
+
+NN::TrainResult NN::train(int trajectories, float* inputs, float* obs_p, float* obs_v, bool detect_anomaly, float* weights, float* sample_loss, int holdout)
 {
+    TrainResult result;
+
+    // Always keep something to train on
+    holdout = max(0, min(holdout, trajectories - 1));
+
+    int ntrain = trajectories - holdout;
+
+    float* holdout_inputs = inputs + ntrain * width * height * features;
+    float* holdout_p = obs_p + ntrain * psize;
+    float* holdout_v = obs_v + ntrain;
+
     mut.lock();
 
+    // Best weights so far, starting with the untrained model
+    vector<Tensor> best_state;
+    float best_loss = 0.0f;
+
+    if (holdout)
+    {
+        result.validated = true;
+
+        mod->eval();
+        validate_locked(holdout, holdout_inputs, holdout_p, holdout_v, &result.initial_policy_loss, &result.initial_value_loss);
+
+        result.policy_loss = result.initial_policy_loss;
+        result.value_loss = result.initial_value_loss;
+        best_loss = result.policy_loss + result.value_loss;
+        best_state = snapshot();
+
+        cout << "Validation on " << holdout << " held out: policy " << result.policy_loss << ", value " << result.value_loss << endl;
+    }
+
+    int patience = options::getInt("training_patience", 2);
+    int stale = 0;
+
     mod->train();
 
     // Detect anomalies
@@ -241,15 +434,26 @@ void NN::train(int trajectories, float* inputs, float* obs_p, float* obs_v, bool
     );
 
     // magic batch picker
-    vector<int> picker(trajectories, 0);
+    vector<int> picker(ntrain, 0);
 
-    auto rng = default_random_engine {};
+    Random& rng = thread_rng();
 
     for (int i = 0; i < (int) picker.size(); ++i)
         picker[i] = i;
 
     int trainbatch_start = 0;
 
+    // With a holdout only the losses of the epoch whose weights are kept are
+    // returned, the first epoch standing in for the initial weights
+    vector<float> epoch_loss;
+    float* loss_dst = sample_loss;
+
+    if (sample_loss && holdout)
+    {
+        epoch_loss.resize(ntrain);
+        loss_dst = epoch_loss.data();
+    }
+
     float firstloss, lastloss;
 
     // start epochs
@@ -262,10 +466,13 @@ void NN::train(int trajectories, float* inputs, float* obs_p, float* obs_v, bool
         float next_input[tbatch][width][height][features];
         float next_policy[tbatch][psize];
         float next_value[tbatch];
+        float next_weight[tbatch];
 
         vector<Tensor> training_inputs;
         vector<Tensor> training_obsp;
         vector<Tensor> training_obsv;
+        vector<Tensor> training_weights;
+        vector<int> training_base;
 
         int batch_base = 0;
 
@@ -294,26 +501,38 @@ void NN::train(int trajectories, float* inputs, float* obs_p, float* obs_v, bool
             for (int j = 0; j < i; ++j)
                 next_value[j] = obs_v[picker[batch_base + j]];
 
+            // copy importance weights
+            for (int j = 0; j < i; ++j)
+                next_weight[j] = weights ? weights[picker[batch_base + j]] : 1.0f;
+
+            training_base.push_back(batch_base);
             batch_base += i;
 
-            // build tensors
+            // build tensors. The batch arrays are reused, so force a copy even
+            // when the device is the CPU, and only take the i filled rows.
             training_inputs.push_back(torch::from_blob(
                 next_input, 
-                {tbatch, width, height, features},
+                {i, width, height, features},
                 kCPU
-            ).to(device, kFloat32));
+            ).to(device, kFloat32, false, true));
 
             training_obsp.push_back(torch::from_blob(
                 next_policy, 
-                {tbatch, psize},
+                {i, psize},
                 kCPU
-            ).to(device, kFloat32));
+            ).to(device, kFloat32, false, true));
 
             training_obsv.push_back(torch::from_blob(
                 next_value, 
-                {tbatch, 1},
+                {i, 1},
                 kCPU
-            ).to(device, kFloat32));
+            ).to(device, kFloat32, false, true));
+
+            training_weights.push_back(torch::from_blob(
+                next_weight,
+                {i},
+                kCPU
+            ).to(device, kFloat32, false, true));
         }
 
         // train
@@ -343,12 +562,24 @@ void NN::train(int trajectories, float* inputs, float* obs_p, float* obs_v, bool
                     throw runtime_error("forward policy output contains NaN");
             }
 
-            Tensor lossval = mod->loss(
-                outputs[0],
-                outputs[1],
-                training_obsp[i],
-                training_obsv[i]
-            );
+            // Same as NNModule::loss() with unit weights: policy loss summed
+            // over the batch, value loss averaged
+            int bsize = training_weights[i].size(0);
+
+            Tensor ploss = mod->sample_policy_loss(outputs[0], training_obsp[i]);
+            Tensor vloss = mod->sample_value_loss(outputs[1], training_obsv[i]);
+
+            Tensor lossval = (ploss + vloss / (double) bsize).mul(training_weights[i]).sum();
+
+            if (loss_dst)
+            {
+                Tensor unscaled = (ploss + vloss).detach().cpu().contiguous();
+
+                float* data = unscaled.data_ptr<float>();
+
+                for (int j = 0; j < bsize; ++j)
+                    loss_dst[picker[training_base[i] + j]] = data[j];
+            }
 
             lossval.backward();
             optimizer.step();
@@ -367,11 +598,52 @@ void NN::train(int trajectories, float* inputs, float* obs_p, float* obs_v, bool
             firstloss = avgloss;
 
         lastloss = avgloss;
+        result.epochs = epoch + 1;
+
+        if (!holdout)
+            continue;
+
+        float vploss, vvloss;
+
+        mod->eval();
+        validate_locked(holdout, holdout_inputs, holdout_p, holdout_v, &vploss, &vvloss);
+        mod->train();
+
+        cout << "Epoch " << epoch + 1 << "/" << epochs << ": validation policy " << vploss << ", value " << vvloss << endl;
+
+        bool best = vploss + vvloss < best_loss;
+
+        if (sample_loss && (best || !epoch))
+            memcpy(sample_loss, loss_dst, sizeof(float) * ntrain);
+
+        if (best)
+        {
+            best_loss = vploss + vvloss;
+            best_state = snapshot();
+            stale = 0;
+
+            result.best_epoch = epoch + 1;
+            result.policy_loss = vploss;
+            result.value_loss = vvloss;
+        }
+        else if (patience > 0 && ++stale >= patience)
+        {
+            cout << "Validation loss stalled for " << stale << " epochs, stopping early" << endl;
+            break;
+        }
+    }
+
+    if (holdout && result.best_epoch < result.epochs)
+    {
+        cout << "Keeping weights from epoch " << result.best_epoch << endl;
+        restore(best_state);
     }
 
     ++generation;
-    cout << "Generated model " << generation << ", average loss " << firstloss << " to " << lastloss << " over " << epochs << " epochs\n";
+    cout << "Generated model " << generation << ", average loss " << firstloss << " to " << lastloss << " over " << result.epochs << " epochs\n";
 
     mod->eval();
     mut.unlock();
+
+    return result;
 }
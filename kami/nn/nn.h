@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <iostream>
 #include <string>
 #include <vector>
 #include <shared_mutex>
@@ -28,13 +29,22 @@ namespace kami {
             torch::nn::Linear valuefc{nullptr};
             std::vector<torch::nn::ModuleHolder<NNResidual>> residuals;
 
-            int width, height, features, psize;
+            int width, height, features, psize, filters;
 
         public:
             NNModule(int width, int height, int features, int psize);
 
+            int get_filters() { return filters; }
+            int get_residuals() { return residuals.size(); }
+
             std::vector<torch::Tensor> forward(torch::Tensor x);
             torch::Tensor loss(torch::Tensor& p, torch::Tensor& v, torch::Tensor& obsp, torch::Tensor& obsv);
+            torch::Tensor policy_loss(torch::Tensor& p, torch::Tensor& obsp);
+            torch::Tensor value_loss(torch::Tensor& v, torch::Tensor& obsv);
+
+            // Per-sample loss terms, shape [batch]
+            torch::Tensor sample_policy_loss(torch::Tensor& p, torch::Tensor& obsp);
+            torch::Tensor sample_value_loss(torch::Tensor& v, torch::Tensor& obsv);
     };
 
     class NN {
@@ -46,6 +56,13 @@ namespace kami {
             int generation;
 
             torch::Device device = torch::kCPU;
+
+            // validate() without taking the model lock
+            void validate_locked(int trajectories, float* inputs, float* obs_p, float* obs_v, float* policy_loss, float* value_loss);
+
+            // Copies of the parameters and buffers, to roll back training
+            std::vector<torch::Tensor> snapshot();
+            void restore(std::vector<torch::Tensor>& state);
         public:
             NN(int width, int height, int features, int psize, bool force_cpu=false);
             NN(NN* other);
@@ -64,11 +81,50 @@ namespace kami {
             int polsize() const { return psize; }
 
             void infer(float* input, int batch, float* policy, float* value);
-            void train(int trajectories, float* inputs, float* obs_p, float* obs_v, bool detect_anomaly=false);
+
+            // Outcome of train(), with validation losses if a holdout was given
+            struct TrainResult {
+                int epochs = 0;
+                int best_epoch = 0; // 0 if no epoch beat the initial weights
+                float initial_policy_loss = 0.0f, initial_value_loss = 0.0f;
+                float policy_loss = 0.0f, value_loss = 0.0f;
+                bool validated = false;
+
+                bool improved() const { return !validated || best_epoch > 0; }
+            };
+
+            /**
+             * Trains the model over the trajectories. If given, `weights` scales
+             * each sample's contribution to the loss, and `sample_loss` receives
+             * each sample's loss from the epoch whose weights are kept.
+             *
+             * The last `holdout` trajectories are not trained on. Their loss is
+             * measured before training and after every epoch, training stops
+             * after `training_patience` epochs without improvement, and the
+             * weights from the best epoch are kept.
+             */
+            TrainResult train(int trajectories, float* inputs, float* obs_p, float* obs_v, bool detect_anomaly=false, float* weights=nullptr, float* sample_loss=nullptr, int holdout=0);
+
+            /**
+             * Computes the mean per-sample policy and value loss over a set of
+             * trajectories without updating the model.
+             */
+            void validate(int trajectories, float* inputs, float* obs_p, float* obs_v, float* policy_loss, float* value_loss);
+
+            long parameter_count();
+
+            // Memory accounting: parameters and buffers, and an estimate of
+            // the activations produced by one forward pass over a batch
+            size_t weight_bytes();
+            size_t activation_bytes(int batch);
 
             void read(std::string path);
             void write(std::string path);
 
+            // Serialize to and from streams, e.g. to ship weights over a socket
+            void read(std::istream& in);
+            void write(std::ostream& out);
+
             NN* clone();
     };
 }
@@ -66,6 +66,18 @@ float options::getFloat(string key, float def)
     }
 }
 
+uint64_t options::getUint64(string key, uint64_t def)
+{
+    string sval;
+
+    try {
+        sval = getStr(key, to_string(def));
+        return stoull(sval);
+    } catch (exception& e) {
+        throw runtime_error(string("conversion failure for key \"") + key + "\" = \"" + sval + "\": " + e.what());
+    }
+}
+
 void options::write(string path)
 {
     lock_guard<mutex> lock(values_lock);
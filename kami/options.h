@@ -1,10 +1,12 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 namespace kami::options {
     int getInt(std::string key, int def=0);
     float getFloat(std::string key, float def=0);
+    uint64_t getUint64(std::string key, uint64_t def=0);
     std::string getStr(std::string key, std::string def="");
 
     void setInt(std::string key, int value);
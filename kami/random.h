@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+namespace kami {
+
+/**
+ * xoshiro256** generator, seeded through splitmix64. Meets the requirements
+ * of UniformRandomBitGenerator, so it works with <random> distributions and
+ * std::shuffle.
+ */
+class Random {
+    public:
+        typedef uint64_t result_type;
+
+        explicit Random(uint64_t seed = 0) { reseed(seed); }
+
+        void reseed(uint64_t seed)
+        {
+            initial = seed;
+
+            for (auto& word : state)
+                word = splitmix64(seed);
+        }
+
+        // Seed given at construction or by the last reseed()
+        uint64_t seed() const { return initial; }
+
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return UINT64_MAX; }
+
+        result_type operator()()
+        {
+            uint64_t result = rotl(state[1] * 5, 7) * 9;
+            uint64_t t = state[1] << 17;
+
+            state[2] ^= state[0];
+            state[3] ^= state[1];
+            state[1] ^= state[2];
+            state[0] ^= state[3];
+            state[2] ^= t;
+            state[3] = rotl(state[3], 45);
+
+            return result;
+        }
+
+        // Uniform in [0, n), for n > 0
+        uint32_t below(uint32_t n) { return (((*this)() >> 32) * n) >> 32; }
+
+        // Uniform in [0, 1)
+        double uniform() { return ((*this)() >> 11) * 0x1.0p-53; }
+
+        // A generator for an independent stream, seeded from this one
+        Random split() { return Random((*this)()); }
+
+        // Advances `x` and returns its next splitmix64 output
+        static uint64_t splitmix64(uint64_t& x)
+        {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+            return z ^ (z >> 31);
+        }
+
+    private:
+        uint64_t state[4];
+        uint64_t initial;
+
+        static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+namespace streams {
+    inline std::atomic<uint64_t> master{
+        std::random_device{}() ^ (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count()
+    };
+
+    // Bumped by seed_streams() so threads pick up the new master seed
+    inline std::atomic<uint64_t> epoch{1};
+    inline std::atomic<uint64_t> next{0};
+}
+
+/**
+ * Seeds the per-thread streams of thread_rng() from `master`, or from the
+ * clock if 0, and returns the master seed. Each thread takes the next stream
+ * on its first draw afterwards, so a single-threaded run is reproduced
+ * exactly by its master seed.
+ */
+inline uint64_t seed_streams(uint64_t master)
+{
+    if (!master)
+        master = std::random_device{}() ^ (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count();
+
+    streams::master = master;
+    streams::next = 0;
+    ++streams::epoch;
+
+    return master;
+}
+
+// This thread's generator, for anything without a stream of its own
+inline Random& thread_rng()
+{
+    thread_local Random rng;
+    thread_local uint64_t epoch = 0;
+
+    if (epoch != streams::epoch.load(std::memory_order_relaxed))
+    {
+        epoch = streams::epoch;
+
+        uint64_t x = streams::master + streams::next++ * 0x632be59bd9b4e019ull;
+        rng.reseed(Random::splitmix64(x));
+    }
+
+    return rng;
+}
+} // namespace kami
@@ -1,42 +1,166 @@
 #pragma once
 
+#include "random.h"
+#include "sumtree.h"
+
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <vector>
 #include <mutex>
+#include <stdexcept>
+#include <unordered_map>
 
 namespace kami {
 
 class ReplayBuffer {
     public:
+        /**
+         * With `prioritized`, samples are drawn proportionally to
+         * priority^alpha (priorities are set from training loss through
+         * update_priorities()), and select_batch() returns importance weights
+         * corrected with exponent beta.
+         *
+         * With `dedup`, samples added with a position key are merged into any
+         * record in the window with the same key: policy targets are averaged
+         * weighted by search visits, values are averaged, and a count is kept.
+         *
+         * With `history`, each record keeps the actions leading to its
+         * position so it can be searched again (see refresh()).
+         */
         ReplayBuffer(
             int obsize,
             int psize,
-            int bufsize) : 
+            int bufsize,
+            bool prioritized = false,
+            float alpha = 0.6f,
+            float beta = 0.4f,
+            bool dedup = false,
+            bool history = false) :
             obsize(obsize),
             psize(psize),
-            bufsize(bufsize)
+            bufsize(bufsize),
+            prioritized(prioritized),
+            alpha(alpha),
+            beta(beta),
+            priorities(bufsize),
+            dedup(dedup),
+            history(history)
         {
             input_buffer = new float[obsize * bufsize];
             mcts_buffer = new float[bufsize * psize];
             result_buffer = new float[bufsize];
+
+            if (dedup)
+            {
+                key_buffer = new uint64_t[bufsize]();
+                visits_buffer = new float[bufsize]();
+                count_buffer = new int[bufsize]();
+                index.reserve(bufsize);
+            }
+
+            if (history)
+                history_buffer.resize(bufsize);
+
+            // Stamps tell whether a record changed since it was picked
+            if (history || prioritized)
+                stamp_buffer = new long[bufsize]();
         }
 
         ~ReplayBuffer() {
             delete[] input_buffer;
             delete[] result_buffer;
             delete[] mcts_buffer;
+            delete[] key_buffer;
+            delete[] visits_buffer;
+            delete[] count_buffer;
+            delete[] stamp_buffer;
         }
 
         void clear() {
+            std::lock_guard<std::mutex> lock(buffer_mut);
+
             total = 0;
+            filled = 0;
             write_index = 0;
+            merged = 0;
+            priorities.clear();
+
+            if (dedup)
+            {
+                index.clear();
+                memset(key_buffer, 0, sizeof(uint64_t) * bufsize);
+            }
+
+            if (history)
+            {
+                for (auto& h : history_buffer)
+                    std::vector<int>().swap(h);
+
+                history_ints = 0;
+            }
+
+            // Picks and selections from before the flush no longer match
+            if (stamp_buffer)
+                memset(stamp_buffer, 0, sizeof(long) * bufsize);
         }
 
-        void add(float* input, float* mcts, float result)
+        /**
+         * Adds a sample. `key` identifies the position for deduplication (0
+         * never merges), `visits` weights its policy target when merged.
+         * `moves` are the actions from the initial position, kept if the
+         * buffer stores histories.
+         */
+        void add(float* input, float* mcts, float result, uint64_t key = 0, float visits = 1.0f, const std::vector<int>* moves = nullptr)
         {
             std::lock_guard<std::mutex> lock(buffer_mut);
 
+            if (dedup && key)
+            {
+                auto it = index.find(key);
+
+                if (it != index.end())
+                {
+                    int slot = it->second;
+                    float* target = mcts_buffer + slot * psize;
+                    float old_visits = visits_buffer[slot];
+                    int count = count_buffer[slot];
+
+                    for (int i = 0; i < psize; ++i)
+                        target[i] = (target[i] * old_visits + mcts[i] * visits) / (old_visits + visits);
+
+                    result_buffer[slot] = (result_buffer[slot] * count + result) / (count + 1);
+                    visits_buffer[slot] = old_visits + visits;
+                    count_buffer[slot] = count + 1;
+
+                    // A refresh or priority update started before the merge
+                    // would undo it
+                    if (stamp_buffer)
+                        stamp_buffer[slot] = ++stamp;
+
+                    ++merged;
+                    ++total;
+                    ++added_total;
+                    return;
+                }
+            }
+
+            if (dedup)
+            {
+                // Evict the record being overwritten from the index
+                if (key_buffer[write_index])
+                    index.erase(key_buffer[write_index]);
+
+                if (key)
+                    index[key] = write_index;
+
+                key_buffer[write_index] = key;
+                visits_buffer[write_index] = visits;
+                count_buffer[write_index] = 1;
+            }
+
             memcpy(
                 input_buffer + write_index * obsize,
                 input,
@@ -49,23 +173,255 @@ class ReplayBuffer {
                 sizeof(float) * psize
             );
 
-            result_buffer[write_index++] = result;
-            write_index %= bufsize;
+            result_buffer[write_index] = result;
+
+            if (history)
+            {
+                std::vector<int>& h = history_buffer[write_index];
+
+                history_ints -= h.size();
+
+                if (moves)
+                    h = *moves;
+                else
+                    h.clear();
+
+                history_ints += h.size();
+            }
+
+            if (stamp_buffer)
+                stamp_buffer[write_index] = ++stamp;
+
+            // New samples get the highest priority seen so they are trained
+            // on at least once
+            if (prioritized)
+                priorities.set(write_index, std::pow(max_priority.load(), alpha));
+
+            write_index = (write_index + 1) % bufsize;
+            filled = std::min(filled + 1, bufsize);
 
             ++total;
+            ++added_total;
+        }
+
+        /**
+         * Sets the priorities of previously selected samples from their
+         * training loss. `stamps` are from select_batch(), records added or
+         * merged into since keep their priority.
+         */
+        void update_priorities(int* indices, long* stamps, float* losses, int n)
+        {
+            if (!prioritized)
+                return;
+
+            std::lock_guard<std::mutex> lock(buffer_mut);
+
+            for (int i = 0; i < n; ++i)
+            {
+                if (indices[i] >= filled || stamp_buffer[indices[i]] != stamps[i])
+                    continue;
+
+                double priority = losses[i] + 1e-4;
+                double cur = max_priority.load();
+
+                while (priority > cur && !max_priority.compare_exchange_weak(cur, priority));
+
+                priorities.set(indices[i], std::pow(priority, alpha));
+            }
+        }
+
+        void get(int slot, float* dst_input, float* dst_mcts, float* dst_result, int* dst_count = nullptr)
+        {
+            std::lock_guard<std::mutex> lock(buffer_mut);
+
+            memcpy(dst_input, input_buffer + slot * obsize, sizeof(float) * obsize);
+            memcpy(dst_mcts, mcts_buffer + slot * psize, sizeof(float) * psize);
+            *dst_result = result_buffer[slot];
+
+            if (dst_count)
+                *dst_count = dedup ? count_buffer[slot] : 1;
+        }
+
+        /**
+         * Picks a random record with a stored history for re-searching.
+         * Returns its stamp and fills `slot` and `moves`, or returns 0 if
+         * none was found.
+         */
+        long pick_stale(int* slot, std::vector<int>& moves)
+        {
+            std::lock_guard<std::mutex> lock(buffer_mut);
+
+            if (!history || !filled)
+                return 0;
+
+            // Records from remote workers have no history, try a few
+            for (int tries = 0; tries < 8; ++tries)
+            {
+                int source = thread_rng().below(filled);
+
+                if (history_buffer[source].size())
+                {
+                    *slot = source;
+                    moves = history_buffer[source];
+                    return stamp_buffer[source];
+                }
+            }
+
+            return 0;
+        }
+
+        /**
+         * Replaces the policy target of a record picked by pick_stale(),
+         * unless it was overwritten or merged into since. The refreshed
+         * record gets the highest priority, like a new sample. Returns true
+         * if the target was replaced.
+         */
+        bool refresh(int slot, long slot_stamp, float* mcts)
+        {
+            std::lock_guard<std::mutex> lock(buffer_mut);
+
+            if (!history || slot >= filled || stamp_buffer[slot] != slot_stamp)
+                return false;
+
+            memcpy(mcts_buffer + slot * psize, mcts, sizeof(float) * psize);
+
+            if (prioritized)
+                priorities.set(slot, std::pow(max_priority.load(), alpha));
+
+            ++refreshed_total;
+            return true;
         }
 
         int size() { return bufsize; }
         long count() { return total; }
 
-        void select_batch(float* dst_input, float* dst_mcts, float* dst_result, int n)
+        // Samples ever added, unaffected by clear()
+        long added() { return added_total; }
+
+        // Targets ever replaced by refresh()
+        long refreshed() { return refreshed_total; }
+
+        // Distinct records currently held, and samples merged into existing ones
+        int records() { return filled; }
+        long merges() { return merged; }
+
+        size_t bytes()
+        {
+            size_t total_bytes = sizeof(float) * (obsize + psize + 1) * (size_t) bufsize;
+
+            // Per-slot key, visits, count and an approximate index entry each
+            if (dedup)
+                total_bytes += (sizeof(uint64_t) + sizeof(float) + sizeof(int) + 32) * (size_t) bufsize;
+
+            // Per-slot history vector, and the actions they hold
+            if (history)
+                total_bytes += sizeof(std::vector<int>) * (size_t) bufsize + sizeof(int) * (size_t) history_ints;
+
+            if (stamp_buffer)
+                total_bytes += sizeof(long) * (size_t) bufsize;
+
+            return total_bytes;
+        }
+
+        bool is_prioritized() { return prioritized; }
+        bool keeps_history() { return history; }
+
+        /**
+         * Selects n samples into the destination buffers. If given, dst_index
+         * receives the buffer index of each sample and dst_weight its
+         * importance weight (normalized to a maximum of 1, always 1 when
+         * sampling uniformly). dst_stamp receives each record's stamp, for
+         * update_priorities().
+         *
+         * The last `holdout` samples are distinct records drawn uniformly,
+         * and are never drawn for the rest of the batch, so they can measure
+         * validation loss. The rest are drawn with replacement and shuffled.
+         */
+        void select_batch(float* dst_input, float* dst_mcts, float* dst_result, int n, int* dst_index = nullptr, float* dst_weight = nullptr, int holdout = 0, long* dst_stamp = nullptr)
         {
             std::lock_guard<std::mutex> lock(buffer_mut);
 
-            // Don't worry about duplicates. Make n selections and copy into the batch.
+            if (!filled)
+                throw std::runtime_error("select_batch() called on empty replay buffer");
+
+            // Always leave a record to train on
+            holdout = std::max(0, std::min({ holdout, n - 1, filled - 1 }));
+
+            int ntrain = n - holdout;
+
+            Random& rng = thread_rng();
+
+            std::vector<int> sources(n);
+            std::vector<float> sample_weights(n, 1.0f);
+            std::vector<char> held(filled, 0);
+
+            // Distinct held out records (Floyd's sampling)
+            for (int j = filled - holdout, i = ntrain; j < filled; ++j, ++i)
+            {
+                int t = rng.below(j + 1);
+
+                if (held[t])
+                    t = j;
+
+                held[t] = 1;
+                sources[i] = t;
+            }
+
+            double mass = priorities.total();
+
+            if (prioritized)
+                for (int i = ntrain; i < n; ++i)
+                    mass -= priorities.get(sources[i]);
+
+            float max_weight = 0.0f;
+
+            // Don't worry about duplicates. Make ntrain selections.
+            for (int i = 0; i < ntrain; ++i)
+            {
+                int source;
+
+                if (prioritized && mass > 0.0)
+                {
+                    // Stratified: one draw from each of ntrain equal slices of
+                    // mass, redrawn from all of it if it lands on a held record
+                    double x = (i + rng.uniform()) * priorities.total() / ntrain;
+
+                    while (held[source = std::min(priorities.find(x), filled - 1)])
+                        x = rng.uniform() * priorities.total();
+
+                    double p = priorities.get(source) / mass;
+                    sample_weights[i] = p > 0.0 ? std::pow((filled - holdout) * p, -beta) : 1.0f;
+                }
+                else
+                {
+                    while (held[source = rng.below(filled)]);
+                }
+
+                sources[i] = source;
+                max_weight = std::max(max_weight, sample_weights[i]);
+            }
+
+            // Stratified draws come out ordered by slot
+            for (int i = ntrain - 1; i > 0; --i)
+            {
+                int j = rng.below(i + 1);
+
+                std::swap(sources[i], sources[j]);
+                std::swap(sample_weights[i], sample_weights[j]);
+            }
+
             for (int i = 0; i < n; ++i)
             {
-                int source = rand() % bufsize;
+                int source = sources[i];
+
+                if (dst_index)
+                    dst_index[i] = source;
+
+                if (dst_stamp)
+                    dst_stamp[i] = stamp_buffer ? stamp_buffer[source] : 0;
+
+                if (dst_weight)
+                    dst_weight[i] = i < ntrain ? sample_weights[i] / max_weight : 1.0f;
 
                 memcpy(
                     dst_input + i * obsize,
@@ -88,6 +444,27 @@ class ReplayBuffer {
         std::mutex buffer_mut;
         float* input_buffer, *result_buffer, *mcts_buffer;
         int write_index = 0;
+        int filled = 0;
         long total = 0;
+        std::atomic<long> added_total{0};
+
+        bool prioritized;
+        float alpha, beta;
+        SumTree priorities;
+        std::atomic<double> max_priority{1.0};
+
+        bool dedup;
+        std::unordered_map<uint64_t, int> index;
+        uint64_t* key_buffer = nullptr;
+        float* visits_buffer = nullptr;
+        int* count_buffer = nullptr;
+        long merged = 0;
+
+        bool history;
+        std::vector<std::vector<int>> history_buffer;
+        long* stamp_buffer = nullptr;
+        long stamp = 0;
+        std::atomic<long> history_ints{0};
+        std::atomic<long> refreshed_total{0};
 }; // class ReplayBuffer
 } // namespace kami
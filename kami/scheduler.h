@@ -0,0 +1,139 @@
+#pragma once
+
+#include "replaybuffer.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace kami {
+
+/**
+ * Keeps the number of training samples consumed per selfplay position
+ * produced close to a target ratio.
+ *
+ * Production is read from the replay buffer, so positions uploaded by remote
+ * workers count as well as local ones, and so do targets refreshed by
+ * reanalysis. The learner is admitted to train on `n` samples once production
+ * has caught up with the ratio, and local actors are held back once they are
+ * more than `slack` consumed samples ahead of the learner. Holding back one
+ * side hands its cores to the other, so neither the learner overfits to stale
+ * positions nor sits idle behind the actors.
+ *
+ * Actors are never held back while the replay window is filling, since the
+ * learner waits for a full window before training.
+ */
+class RateScheduler {
+    public:
+        RateScheduler(ReplayBuffer* replay_buffer, float ratio, long slack) :
+            replay_buffer(replay_buffer),
+            ratio(ratio),
+            slack(slack) {}
+
+        bool enabled() { return ratio > 0.0f; }
+
+        /**
+         * Blocks an actor while production is too far ahead of the learner.
+         * Returns false if still throttled after `timeout_ms`.
+         */
+        bool actor_wait(int timeout_ms)
+        {
+            if (!enabled())
+                return true;
+
+            auto start = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> guard(lock);
+
+            bool ready = cv.wait_for(guard, std::chrono::milliseconds(timeout_ms), [&]() {
+                return filling() || lead() <= slack;
+            });
+
+            actor_wait_ms += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            return ready;
+        }
+
+        /**
+         * Blocks the learner until it may consume `n` samples without getting
+         * ahead of the ratio, then records them as consumed (releasing any
+         * throttled actors while it trains). Returns false if not admitted
+         * after `timeout_ms`.
+         */
+        bool learner_admit(long n, int timeout_ms)
+        {
+            if (enabled())
+            {
+                auto start = std::chrono::steady_clock::now();
+                auto deadline = start + std::chrono::milliseconds(timeout_ms);
+
+                // Production isn't signalled, poll the buffer
+                while (n - lead() > slack)
+                {
+                    if (std::chrono::steady_clock::now() >= deadline)
+                    {
+                        learner_wait_ms += timeout_ms;
+                        return false;
+                    }
+
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+
+                learner_wait_ms += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                consumed += n;
+            }
+
+            cv.notify_all();
+            return true;
+        }
+
+        /**
+         * Corrects the consumption recorded by learner_admit() once training
+         * is done, e.g. when early stopping ran fewer epochs than admitted.
+         */
+        void settle(long admitted, long trained)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                consumed += trained - admitted;
+            }
+
+            cv.notify_all();
+        }
+
+        long get_consumed() { return consumed; }
+        long get_produced() { return replay_buffer->added() + replay_buffer->refreshed(); }
+        float get_target() { return ratio; }
+
+        // Observed samples consumed per position produced
+        float get_ratio()
+        {
+            long produced = get_produced();
+            return produced ? (float) consumed / produced : 0.0f;
+        }
+
+        // Milliseconds actors spent throttled and the learner spent waiting
+        long get_actor_wait_ms() { return actor_wait_ms; }
+        long get_learner_wait_ms() { return learner_wait_ms; }
+
+    private:
+        ReplayBuffer* replay_buffer;
+        float ratio;
+        long slack;
+
+        std::mutex lock;
+        std::condition_variable cv;
+        std::atomic<long> consumed{0};
+        std::atomic<long> actor_wait_ms{0}, learner_wait_ms{0};
+
+        // Samples the learner owes to match production at the target ratio
+        long lead() { return (long) (get_produced() * ratio) - consumed; }
+
+        // The learner can't start until the window is full, e.g. after a flush
+        bool filling() { return replay_buffer->count() < replay_buffer->size(); }
+};
+} // namespace kami
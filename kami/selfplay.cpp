@@ -1,37 +1,90 @@
 #include "selfplay.h"
 #include "env.h"
+#include "gamedriver.h"
 #include "mcts.h"
 #include "evaluate.h"
 #include "options.h"
 
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <cmath>
 
 using namespace kami;
 using namespace std;
 
+// Heap held by a buffered sample, including its copy of the move history
+static size_t sample_bytes(const Selfplay::Sample& t)
+{
+    return sizeof(t) + sizeof(t.inputs[0]) * t.inputs.capacity()
+        + sizeof(t.mcts[0]) * t.mcts.capacity()
+        + sizeof(t.moves[0]) * t.moves.capacity();
+}
+
 Selfplay::Selfplay(NN* model) :
     model(model),
     ibatch(options::getInt("selfplay_batch", 16)),
     nodes(options::getInt("selfplay_nodes", 512)),
     wants_pgn(false),
-    replay_buffer(OBSIZE, PSIZE, options::getInt("replaybuffer_size", 512)) {}
+    replay_buffer(
+        OBSIZE,
+        PSIZE,
+        options::getInt("replaybuffer_size", 512),
+        options::getInt("replaybuffer_prioritized", 0),
+        options::getInt("replaybuffer_alpha_pct", 60) / 100.0f,
+        options::getInt("replaybuffer_beta_pct", 40) / 100.0f,
+        options::getInt("replaybuffer_dedup", 0),
+        // Reanalysis searches records again from their move history (off
+        // with an inference server, see kami.cpp)
+        options::getInt("reanalysis_threads", 0) > 0
+    ),
+    trajectories(options::getInt("replaybuffer_size", 512) * options::getInt("training_sample_pct", 60) / 100),
+    scheduler(
+        &replay_buffer,
+        // Nothing to balance against without a local learner
+        options::getInt("training_threads", 1) ? options::getFloat("sample_reuse_ratio", 0.0f) : 0.0f,
+        // Actors may run one training round ahead of the learner
+        (long) trajectories * options::getInt("training_epochs", 8)
+    ) {}
+
+// Games parked in the pool are destroyed here, where they are complete
+Selfplay::~Selfplay() {}
 
 void Selfplay::start()
 {
     status.code(RUNNING);
 
-    int n_inference = options::getInt("inference_threads", 1);
+    string seed_log_path = options::getStr("selfplay_seed_log");
+
+    if (seed_log_path.size() && !seed_log.is_open())
+    {
+        seed_log.open(seed_log_path, ios::app);
+
+        if (!seed_log)
+            cerr << "WARNING: couldn't open seed log " << seed_log_path << endl;
+    }
+
+    // Coroutine games wait on one evaluation at a time
+    if (options::getInt("selfplay_coroutines", 0) > 0 && options::getInt("mcts_async", 0))
+        cerr << "WARNING: mcts_async has no effect with selfplay_coroutines" << endl;
 
-    for (int i = 0; i < n_inference; ++i)
     {
-        partial_trajectories.emplace_back(0);
-        inference.push_back(thread(&Selfplay::inference_main, this, i));
+        lock_guard<mutex> lock(workers_lock);
+
+        for (int i = 0; i < options::getInt("inference_threads", 1); ++i)
+            spawn_worker();
     }
 
     for (int i = 0; i < options::getInt("training_threads", 1); ++i)
         training.push_back(thread(&Selfplay::training_main, this, i));
+
+    // Histories are kept by the replay buffer, which is remote when using
+    // an inference server
+    if (!inference_client)
+    {
+        for (int i = 0; i < options::getInt("reanalysis_threads", 0); ++i)
+            reanalysis.push_back(thread(&Selfplay::reanalysis_main, this, i));
+    }
 }
 
 void Selfplay::stop()
@@ -42,23 +95,183 @@ void Selfplay::stop()
     status.code(WAITING);
 
     // Wait for threads
-    for (auto& t : inference)
-        t.join();
+    for (auto& w : workers)
+        w.thread.join();
 
-    inference.clear();
+    {
+        lock_guard<mutex> lock(workers_lock);
+        workers.clear();
+    }
 
     for (auto& t : training)
         t.join();
 
     training.clear();
 
+    for (auto& t : reanalysis)
+        t.join();
+
+    reanalysis.clear();
+
     status.code(STOPPED);
 }
 
-void Selfplay::inference_main(int id) {
+void Selfplay::spawn_worker()
+{
+    bool coroutines = options::getInt("selfplay_coroutines", 0) > 0;
+
+    workers.emplace_back();
+
+    Worker* w = &workers.back();
+    w->id = next_worker++;
+    w->thread = thread(coroutines ? &Selfplay::coroutine_main : &Selfplay::inference_main, this, w);
+}
+
+void Selfplay::add_workers(int n)
+{
+    if (status.code() != RUNNING)
+        throw runtime_error("add_workers() called when not running");
+
+    if (options::getInt("selfplay_coroutines", 0) > 0)
+        throw runtime_error("workers can't be resized with selfplay_coroutines");
+
+    lock_guard<mutex> lock(workers_lock);
+
+    // Each thread holds a slot for as long as it runs
+    if (inference_client && (int) workers.size() + n > inference_client->get_slots())
+        throw runtime_error("inference client has " + to_string(inference_client->get_slots()) + " slots");
+
+    for (int i = 0; i < n; ++i)
+        spawn_worker();
+}
+
+void Selfplay::remove_workers(int n)
+{
+    if (status.code() != RUNNING)
+        throw runtime_error("remove_workers() called when not running");
+
+    if (options::getInt("selfplay_coroutines", 0) > 0)
+        throw runtime_error("workers can't be resized with selfplay_coroutines");
+
+    vector<Worker*> retiring;
+
+    {
+        lock_guard<mutex> lock(workers_lock);
+
+        // Keep at least one worker, stop() is for the rest
+        if (n >= (int) workers.size())
+            throw runtime_error("can't remove " + to_string(n) + " of " + to_string(workers.size()) + " workers");
+
+        auto it = workers.end();
+
+        for (int i = 0; i < n; ++i)
+        {
+            --it;
+            it->retire = true;
+            retiring.push_back(&*it);
+        }
+    }
+
+    // Retiring workers park their games after the current batch
+    for (Worker* w : retiring)
+        w->thread.join();
+
+    lock_guard<mutex> lock(workers_lock);
+    workers.remove_if([](Worker& w) { return w.retire.load(); });
+}
+
+void Selfplay::set_batch(int batch)
+{
+    if (batch < 1)
+        throw runtime_error("selfplay batch must be positive");
+
+    if (options::getInt("selfplay_coroutines", 0) > 0)
+        throw runtime_error("batch size can't be changed with selfplay_coroutines");
+
+    int async_leaves = options::getInt("mcts_async", 0) ? max(1, options::getInt("mcts_async_leaves", 4)) : 1;
+
+    if (inference_client && batch * async_leaves > inference_client->get_slot_batch())
+        throw runtime_error("selfplay batch exceeds inference client slot size");
+
+    ibatch = batch;
+}
+
+int Selfplay::get_workers()
+{
+    lock_guard<mutex> lock(workers_lock);
+    return workers.size();
+}
+
+int Selfplay::get_parked_games()
+{
+    lock_guard<mutex> lock(parked_lock);
+    return parked.size();
+}
+
+Selfplay::MemoryUsage Selfplay::memory_usage()
+{
+    MemoryUsage usage;
+    lock_guard<mutex> lock(workers_lock);
+
+    for (auto& w : workers)
+    {
+        usage.tree_nodes += w.tree_nodes;
+        usage.tree_bytes += w.tree_bytes;
+        usage.trajectory_bytes += w.trajectory_bytes;
+    }
+
+    usage.replay_bytes = replay_buffer.bytes();
+    usage.weight_bytes = model->weight_bytes();
+    usage.activation_bytes = model->activation_bytes(ibatch) * workers.size();
+
+    return usage;
+}
+
+struct kami::SelfplayGame {
+    MCTS tree;
+
+    // Samples hold the mover's POV in `result` until the game ends
+    vector<Selfplay::Sample> trajectory;
+    int source_generation;
+
+    // Actions played, if the replay buffer keeps histories
+    vector<int> moves;
+};
+
+void Selfplay::balance_games(vector<unique_ptr<SelfplayGame>>& games, int n)
+{
+    lock_guard<mutex> lock(parked_lock);
+
+    while ((int) games.size() > n)
+    {
+        parked.push_back(move(games.back()));
+        games.pop_back();
+    }
+
+    // Resume the longest parked games first
+    while ((int) games.size() < n)
+    {
+        if (parked.size())
+        {
+            games.push_back(move(parked.front()));
+            parked.pop_front();
+        }
+        else
+        {
+            games.emplace_back(new SelfplayGame());
+            games.back()->source_generation = current_generation();
+        }
+    }
+}
+
+void Selfplay::inference_main(Worker* worker) {
+    int id = worker->id;
+
     cout << "Starting inference thread: " << id << endl;
 
-    bool flush_old_trees = options::getInt("flush_old_trees", 1);
+    // Trees from an older model are replaced, unless they are re-scored
+    // lazily as they're searched
+    bool flush_old_trees = options::getInt("flush_old_trees", 1) && !options::getInt("mcts_rescore_visits", 0);
     
     // Value used for training the network in draw situations.
     // The search will still consider draws neutral, but hopefully
@@ -74,117 +287,164 @@ void Selfplay::inference_main(int id) {
     float alpha_final = options::getFloat("selfplay_alpha_final", 1.0f);
     int alpha_cutoff = options::getFloat("selfplay_alpha_cutoff", 1.0f);
 
-    struct T {
-        T(float* i, float* m, float pov) {
-            inputs = new float[OBSIZE];
-            mcts = new float[PSIZE];
+    // With provisional leaves, each tree can have several evaluations in
+    // every batch
+    bool async = options::getInt("mcts_async", 0);
+    int async_leaves = async ? max(1, options::getInt("mcts_async_leaves", 4)) : 1;
 
-            memcpy(inputs, i, sizeof(float) * OBSIZE);
-            memcpy(mcts, m, sizeof(float) * PSIZE);
+    vector<int> tickets, owners;
 
-            this->pov = pov;
-        }
+    bool keep_moves = replay_buffer.keeps_history();
 
-        ~T() {
-            delete[] inputs;
-            delete[] mcts;
-        }
+    // Games in progress, adopted from and handed back to the parked pool
+    // as the batch size changes
+    vector<unique_ptr<SelfplayGame>> games;
 
-        float* inputs = nullptr, *mcts = nullptr, pov;
-    };
-    
-    // Spin up environments
-    MCTS trees[ibatch];
-    vector<vector<T*>> trajectories;
-    vector<int> source_generation;
+    float* batch = nullptr, *inf_value = nullptr, *inf_policy = nullptr;
+    int slot = -1, capacity = 0;
 
-    for (int i = 0; i < ibatch; ++i)
+    if (inference_client)
     {
-        trajectories.emplace_back();
-        source_generation.push_back(model->get_generation());
+        if (ibatch * async_leaves > inference_client->get_slot_batch())
+            throw runtime_error("selfplay batch exceeds inference client slot size");
+
+        // Build batches in shared memory, the server reads them in place
+        slot = inference_client->acquire();
+        batch = inference_client->inputs(slot);
+        inf_value = inference_client->value(slot);
+        inf_policy = inference_client->policy(slot);
     }
 
-    float* batch = new float[ibatch * OBSIZE];
-    float* inf_value = new float[ibatch];
-    float* inf_policy = new float[ibatch * PSIZE];
+    while (status.code() == RUNNING && !worker->retire)
+    {
+        // Hold back while the learner is behind the target reuse ratio
+        if (!scheduler.actor_wait(100))
+            continue;
 
-    int partials = 0;
+        // Follow batch size changes, every search is between evaluations here
+        int games_batch = ibatch;
+
+        if ((int) games.size() != games_batch)
+            balance_games(games, games_batch);
+
+        if (games_batch * async_leaves > capacity)
+        {
+            capacity = games_batch * async_leaves;
+
+            tickets.resize(capacity);
+            owners.resize(capacity);
+
+            if (!inference_client)
+            {
+                delete[] batch;
+                delete[] inf_value;
+                delete[] inf_policy;
+
+                batch = new float[capacity * OBSIZE];
+                inf_value = new float[capacity];
+                inf_policy = new float[capacity * PSIZE];
+            }
+        }
 
-    while (status.code() == RUNNING)
-    {
         // Build next batch
-        for (int i = 0; i < ibatch; ++i)
+        int count = 0;
+
+        for (int i = 0; i < games_batch; ++i)
         {
+            MCTS& tree = games[i]->tree;
+            vector<Sample>& trajectory = games[i]->trajectory;
+            vector<int>& moves = games[i]->moves;
+
+            int generation = current_generation();
+
             // Check if tree is out of date and needs replacing
-            if (flush_old_trees && source_generation[i] < model->get_generation())
+            if (flush_old_trees && games[i]->source_generation < generation)
             {
                 // Replace environment and start again
-                trees[i].reset();
+                tree.reset();
+                trajectory.clear();
+                moves.clear();
+                games[i]->source_generation = generation;
+            }
 
-                for (T*& t : trajectories[i])
-                    delete t;
+            tree.set_generation(generation);
 
-                partials -= trajectories[i].size();
-                trajectories[i].clear();
-                source_generation[i] = model->get_generation();
-            }
+            if (async)
+            {
+                // Queue leaves up to the limit, each expanded provisionally
+                while (tree.n() < nodes && tree.in_flight() < async_leaves)
+                {
+                    int ticket = tree.select_async(batch + count * OBSIZE);
 
-            // Push up to node limit, or next observation
-            while (trees[i].n() < nodes && !trees[i].select(batch + i * OBSIZE));
+                    if (ticket >= 0)
+                    {
+                        tickets[count] = ticket;
+                        owners[count++] = i;
+                    }
+                }
 
-            // If not ready, this observation is done
-            if (trees[i].n() < nodes) continue;
+                // The search isn't done until its evaluations are back
+                if (tree.n() < nodes || tree.in_flight()) continue;
+            }
+            else
+            {
+                // Push up to node limit, or next observation
+                while (tree.n() < nodes && !tree.select(batch + i * OBSIZE));
+
+                // If not ready, this observation is done
+                if (tree.n() < nodes) continue;
+            }
 
             // Otherwise, save this trajectory and perform the action
+            Sample t;
 
-            // Reuse batch space, it will be overwritten anyway
-            trees[i].get_env().observe(batch + i * OBSIZE);
+            t.inputs.resize(OBSIZE);
+            t.mcts.resize(PSIZE);
 
-            float mcts[PSIZE];
-            trees[i].snapshot(mcts);
+            tree.get_env().observe(t.inputs.data());
+            tree.snapshot(t.mcts.data());
 
-            // We've selected an action and pushed it -- the color which made
-            // the action is the opposite of the current color to move.
-            float pov = -trees[i].get_env().turn();
+            // POV of the color making the action, until the game ends
+            t.result = -tree.get_env().turn();
+            t.key = tree.get_env().key();
+            t.visits = tree.n();
+            t.moves = moves;
 
-            ++partials;
-            trajectories[i].push_back(new T(batch + i * OBSIZE, mcts, pov));
+            trajectory.push_back(move(t));
 
             float alpha = alpha_final;
 
-            if (trees[i].get_env().ply() < alpha_cutoff)
-                alpha = pow(alpha_decay, trees[i].get_env().ply()) * alpha_initial;
+            if (tree.get_env().ply() < alpha_cutoff)
+                alpha = pow(alpha_decay, tree.get_env().ply()) * alpha_initial;
+
+            int picked = tree.pick(alpha);
 
-            int picked = trees[i].pick(alpha);
+            tree.push(picked);
 
-            trees[i].push(picked);
+            if (keep_moves)
+                moves.push_back(picked);
+
+            {
+                lock_guard<mutex> lock(search_lock);
+                search_totals.merge(tree.last_search_stats());
+            }
 
             // Check terminal state
             float value;
 
-            if (trees[i].get_env().terminal(&value))
+            if (tree.get_env().terminal(&value))
             {
-                if (wants_pgn.exchange(false))
-                {
-                    ret_pgn = trees[i].get_env().pgn();
-                    wants_pgn = false;
-                }
+                record_game(tree);
 
                 // Replace environment and reobserve
-                trees[i].reset();
+                tree.reset();
 
-                if (value == 0.0f) for (auto& t : trajectories[i])
-                {
-                    replay_buffer.add(t->inputs, t->mcts, draw_value);
-                    delete t;
-                } else for (auto& t : trajectories[i])
-                {
-                    replay_buffer.add(t->inputs, t->mcts, t->pov * value);
-                    delete t;
-                }
+                for (auto& t : trajectory)
+                    t.result = value == 0.0f ? draw_value : t.result * value;
 
-                partials -= trajectories[i].size();
-                trajectories[i].clear();
+                emit_game(trajectory);
+                trajectory.clear();
+                moves.clear();
             }
 
             // Try again on new env
@@ -193,23 +453,386 @@ void Selfplay::inference_main(int id) {
         }
 
         // Inference
-        model->infer(batch, ibatch, inf_policy, inf_value);
+        if (!async)
+            count = games_batch;
+
+        if (inference_client)
+        {
+            inference_client->submit(slot, count);
+            inference_client->wait(slot);
+        }
+        else
+            model->infer(batch, count, inf_policy, inf_value);
+
+        // Expansion, or correction of provisional leaves
+        if (async)
+        {
+            for (int j = 0; j < count; ++j)
+                games[owners[j]]->tree.resolve(tickets[j], inf_policy + j * PSIZE, inf_value[j]);
+        }
+        else
+        {
+            for (int i = 0; i < games_batch; ++i)
+                games[i]->tree.expand(inf_policy + i * PSIZE, inf_value[i]);
+        }
+
+        // Update worker stats
+        int partials = 0;
+        long tree_nodes = 0;
+        size_t tree_bytes = 0;
+        size_t trajectory_bytes = 0;
+
+        for (auto& g : games)
+        {
+            partials += g->trajectory.size();
+            tree_nodes += g->tree.nodes();
+            tree_bytes += g->tree.bytes();
+
+            for (auto& t : g->trajectory)
+                trajectory_bytes += sample_bytes(t);
+        }
+
+        worker->partials = partials;
+        worker->tree_nodes = tree_nodes;
+        worker->tree_bytes = tree_bytes;
+        worker->trajectory_bytes = trajectory_bytes;
+    }
+
+    // Hand the games to the other workers, or keep them for the next start()
+    balance_games(games, 0);
+
+    if (inference_client)
+        inference_client->release(slot);
+    else
+    {
+        delete[] batch;
+        delete[] inf_value;
+        delete[] inf_policy;
+    }
+
+    cout << "Terminating inference thread: " << id << endl;
+}
+
+struct kami::CoroutineGame {
+    MCTS tree;
+    int partials = 0;
+    size_t trajectory_bytes = 0;
+};
+
+void Selfplay::record_game(MCTS& tree)
+{
+    if (wants_pgn.exchange(false))
+    {
+        ret_pgn = "[Seed \"" + to_string(tree.get_seed()) + "\"]\n" + tree.get_env().pgn();
+        wants_pgn = false;
+    }
+
+    if (seed_log.is_open())
+    {
+        float value;
+        tree.get_env().terminal(&value);
+
+        lock_guard<mutex> lock(seed_log_lock);
+        seed_log << tree.get_seed() << " " << current_generation() << " " << tree.get_env().ply() << " " << value << endl;
+    }
+}
+
+void Selfplay::emit_game(vector<Sample>& game)
+{
+    if (game_sink)
+    {
+        game_sink(game);
+        return;
+    }
+
+    for (auto& t : game)
+        replay_buffer.add(t.inputs.data(), t.mcts.data(), t.result, t.key, t.visits, &t.moves);
+}
+
+GameTask Selfplay::play_game(CoroutineGame& game, InferenceBatcher& batcher)
+{
+    // Trees from an older model are replaced, unless they are re-scored
+    // lazily as they're searched
+    bool flush_old_trees = options::getInt("flush_old_trees", 1) && !options::getInt("mcts_rescore_visits", 0);
+    float draw_value = (options::getInt("draw_value_pct", 50) / 100.0f) * 2.0f - 1.0f;
+
+    float alpha_initial = options::getFloat("selfplay_alpha_initial", 1.0f);
+    float alpha_decay = options::getFloat("selfplay_alpha_decay", 1.0f);
+    float alpha_final = options::getFloat("selfplay_alpha_final", 1.0f);
+    int alpha_cutoff = options::getFloat("selfplay_alpha_cutoff", 1.0f);
+
+    MCTS& tree = game.tree;
+
+    // Samples hold the mover's POV in `result` until the game ends
+    vector<Sample> trajectory;
+    int source_generation = current_generation();
+
+    bool keep_moves = replay_buffer.keeps_history();
+    vector<int> moves;
+
+    while (status.code() == RUNNING)
+    {
+        int generation = current_generation();
+
+        if (flush_old_trees && source_generation < generation)
+        {
+            tree.reset();
+            trajectory.clear();
+            moves.clear();
+            game.partials = 0;
+            game.trajectory_bytes = 0;
+            source_generation = generation;
+        }
+
+        tree.set_generation(generation);
+
+        // Search, suspending for each evaluation
+        while (tree.n() < nodes)
+        {
+            co_await batcher.reserve();
+
+            if (!tree.select(batcher.input()))
+                continue;
+
+            InferenceBatcher::Result result = co_await batcher.evaluate();
+            tree.expand(result.policy, result.value);
+        }
+
+        Sample t;
+
+        t.inputs.resize(OBSIZE);
+        t.mcts.resize(PSIZE);
+
+        tree.get_env().observe(t.inputs.data());
+        tree.snapshot(t.mcts.data());
 
-        // Expansion
-        for (int i = 0; i < ibatch; ++i)
-            trees[i].expand(inf_policy + i * PSIZE, inf_value[i]);
+        t.result = -tree.get_env().turn();
+        t.key = tree.get_env().key();
+        t.visits = tree.n();
+        t.moves = moves;
 
-        // Update partial trajectories
-        auto pt = partial_trajectories.begin();
-        advance(pt, id);
-        *pt = partials;
+        game.trajectory_bytes += sample_bytes(t);
+        trajectory.push_back(move(t));
+        game.partials = trajectory.size();
+
+        float alpha = alpha_final;
+
+        if (tree.get_env().ply() < alpha_cutoff)
+            alpha = pow(alpha_decay, tree.get_env().ply()) * alpha_initial;
+
+        int picked = tree.pick(alpha);
+
+        tree.push(picked);
+
+        if (keep_moves)
+            moves.push_back(picked);
+
+        {
+            lock_guard<mutex> lock(search_lock);
+            search_totals.merge(tree.last_search_stats());
+        }
+
+        float value;
+
+        if (tree.get_env().terminal(&value))
+        {
+            record_game(tree);
+            tree.reset();
+
+            for (auto& t : trajectory)
+                t.result = value == 0.0f ? draw_value : t.result * value;
+
+            emit_game(trajectory);
+
+            trajectory.clear();
+            moves.clear();
+            game.partials = 0;
+            game.trajectory_bytes = 0;
+        }
+    }
+}
+
+void Selfplay::coroutine_main(Worker* worker)
+{
+    int id = worker->id;
+    int games = options::getInt("selfplay_coroutines", 0);
+
+    cout << "Starting coroutine selfplay thread " << id << ": " << games << " games, batches of " << ibatch << endl;
+
+    float* batch, *inf_value, *inf_policy;
+    int slot = -1;
+
+    if (inference_client)
+    {
+        if (ibatch > inference_client->get_slot_batch())
+            throw runtime_error("selfplay batch exceeds inference client slot size");
+
+        slot = inference_client->acquire();
+        batch = inference_client->inputs(slot);
+        inf_value = inference_client->value(slot);
+        inf_policy = inference_client->policy(slot);
+    }
+    else
+    {
+        batch = new float[ibatch * OBSIZE];
+        inf_value = new float[ibatch];
+        inf_policy = new float[ibatch * PSIZE];
+    }
+
+    InferenceBatcher batcher(ibatch, batch, inf_policy, inf_value);
+
+    // Games reference their state, so tasks are destroyed first
+    vector<unique_ptr<CoroutineGame>> states;
+    vector<GameTask> tasks;
+
+    for (int i = 0; i < games; ++i)
+    {
+        states.emplace_back(new CoroutineGame());
+        tasks.push_back(play_game(*states.back(), batcher));
+        InferenceBatcher::check(tasks.back());
+    }
+
+    while (status.code() == RUNNING)
+    {
+        // Hold back while the learner is behind the target reuse ratio
+        if (!scheduler.actor_wait(100))
+            continue;
+
+        int n = batcher.fill();
+
+        // Games only return after seeing the stop, which ends the loop first,
+        // so this is only a guard against a batcher with no games
+        if (!n)
+            break;
+
+        if (inference_client)
+        {
+            inference_client->submit(slot, n);
+            inference_client->wait(slot);
+        }
+        else
+            model->infer(batch, n, inf_policy, inf_value);
+
+        batcher.complete();
+
+        // Update worker stats
+        int partials = 0;
+        long tree_nodes = 0;
+        size_t tree_bytes = 0;
+        size_t trajectory_bytes = 0;
+
+        for (auto& g : states)
+        {
+            partials += g->partials;
+            tree_nodes += g->tree.nodes();
+            tree_bytes += g->tree.bytes();
+            trajectory_bytes += g->trajectory_bytes;
+        }
+
+        worker->partials = partials;
+        worker->tree_nodes = tree_nodes;
+        worker->tree_bytes = tree_bytes;
+        worker->trajectory_bytes = trajectory_bytes;
+    }
+
+    tasks.clear();
+    states.clear();
+
+    if (inference_client)
+        inference_client->release(slot);
+    else
+    {
+        delete[] batch;
+        delete[] inf_value;
+        delete[] inf_policy;
+    }
+
+    cout << "Terminating coroutine selfplay thread: " << id << endl;
+}
+
+void Selfplay::reanalysis_main(int id)
+{
+    int rbatch = options::getInt("reanalysis_batch", 16);
+    int rnodes = options::getInt("reanalysis_nodes", 64);
+    float rpace = options::getInt("reanalysis_pct", 50) / 100.0f;
+
+    cout << "Starting reanalysis thread " << id << ": " << rbatch << " positions, " << rnodes << " nodes" << endl;
+
+    // One search per stored position, identified by its slot and stamp (0
+    // when idle)
+    vector<MCTS> trees(rbatch);
+    vector<int> slots(rbatch, -1), owners(rbatch);
+    vector<long> stamps(rbatch, 0);
+    vector<int> moves;
+
+    float* batch = new float[rbatch * OBSIZE];
+    float* inf_value = new float[rbatch];
+    float* inf_policy = new float[rbatch * PSIZE];
+
+    while (status.code() == RUNNING)
+    {
+        // Throttled with the actors, refreshed targets count as production
+        if (!scheduler.actor_wait(100))
+            continue;
+
+        // Paced by selfplay production, whether or not the scheduler is on
+        if (replay_buffer.refreshed() >= replay_buffer.added() * rpace)
+        {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            continue;
+        }
+
+        int count = 0;
+
+        for (int i = 0; i < rbatch; ++i)
+        {
+            if (!stamps[i])
+            {
+                stamps[i] = replay_buffer.pick_stale(&slots[i], moves);
+
+                // Nothing stored to reanalyse yet
+                if (!stamps[i])
+                    continue;
+
+                trees[i].reset(moves);
+            }
+
+            while (trees[i].n() < rnodes && !trees[i].select(batch + count * OBSIZE));
+
+            if (trees[i].n() < rnodes)
+            {
+                owners[count++] = i;
+                continue;
+            }
+
+            // Search done, replace the target unless the record has changed
+            float mcts[PSIZE];
+            trees[i].snapshot(mcts);
+
+            replay_buffer.refresh(slots[i], stamps[i], mcts);
+            stamps[i] = 0;
+
+            // Start on another position
+            --i;
+        }
+
+        if (!count)
+        {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            continue;
+        }
+
+        model->infer(batch, count, inf_policy, inf_value);
+
+        for (int j = 0; j < count; ++j)
+            trees[owners[j]].expand(inf_policy + j * PSIZE, inf_value[j]);
     }
 
     delete[] batch;
     delete[] inf_value;
     delete[] inf_policy;
 
-    cout << "Terminating inference thread: " << id << endl;
+    cout << "Terminating reanalysis thread: " << id << endl;
 }
 
 void Selfplay::training_main(int id)
@@ -220,9 +843,14 @@ void Selfplay::training_main(int id)
 
     long target_count = replay_buffer.size(), target_from = 0;
     int target_incr = replay_buffer.size() * options::getInt("rpb_train_pct", 40) / 100;
-    int trajectories = replay_buffer.size() * options::getInt("training_sample_pct", 60) / 100;
     bool detect_anomaly = options::getInt("training_detect_anomaly", 0);
 
+    // Samples kept back from training to measure validation loss
+    int holdout = min(trajectories - 1, trajectories * options::getInt("training_holdout_pct", 0) / 100);
+
+    // Samples consumed by a full training round, settled after early stopping
+    long consumption = (long) (trajectories - holdout) * options::getInt("training_epochs", 8);
+
     if (detect_anomaly && !id)
         cout << "Anomaly detection enabled" << endl;
 
@@ -230,28 +858,52 @@ void Selfplay::training_main(int id)
     float* mcts = new float[trajectories * PSIZE];
     float* results = new float[trajectories];
 
+    // Prioritized replay: sample indices and stamps, importance weights and
+    // losses
+    int* indices = new int[trajectories];
+    long* stamps = new long[trajectories];
+    float* weights = new float[trajectories];
+    float* losses = new float[trajectories];
+
     // Wait for total trajectory target
     while (status.code() == RUNNING)
     {
-        // Check if target percentage reached, also grab the current generation
-        if (replay_buffer.count() < target_count)
+        // Check if target percentage reached, or with a target reuse ratio
+        // wait for the window to fill and for enough new positions
+        bool ready;
+
+        if (scheduler.enabled())
+            ready = replay_buffer.count() >= replay_buffer.size() && scheduler.learner_admit(consumption, 1000);
+        else
+            ready = replay_buffer.count() >= target_count;
+
+        if (!ready)
         {
             if (!id)
             {
-                cout << "Gen " << model->get_generation() << " RPB " << 100 * (replay_buffer.count() - target_from) / (target_count - target_from) << "% [" << replay_buffer.count() - target_from << " / " << target_count - target_from << "] | Partials: ";
+                cout << "Gen " << model->get_generation();
+
+                if (scheduler.enabled())
+                    cout << " reuse " << scheduler.get_ratio() << " / " << scheduler.get_target() << " RPB " << replay_buffer.count();
+                else
+                    cout << " RPB " << 100 * (replay_buffer.count() - target_from) / (target_count - target_from) << "% [" << replay_buffer.count() - target_from << " / " << target_count - target_from << "]";
 
-                auto ct = partial_trajectories.begin();
+                cout << " | Partials: ";
 
-                for (int inf = 0; inf < inference.size(); ++inf)
                 {
-                    cout << " Inf " << inf << ": " << *ct;
-                    ++ct;
+                    lock_guard<mutex> lock(workers_lock);
+
+                    for (auto& w : workers)
+                        cout << " Inf " << w.id << ": " << w.partials;
                 }
 
                 cout << endl;
             }
 
-            this_thread::sleep_for(chrono::milliseconds(1000));
+            // learner_admit() has already waited
+            if (!scheduler.enabled() || replay_buffer.count() < replay_buffer.size())
+                this_thread::sleep_for(chrono::milliseconds(1000));
+
             continue;
         }
 
@@ -261,18 +913,49 @@ void Selfplay::training_main(int id)
         // Clone the current model
         NN cmodel(model);
 
-        // Train new model
-        replay_buffer.select_batch(inputs, mcts, results, trajectories);
-        cmodel.train(trajectories, inputs, mcts, results, detect_anomaly);
+        // Train new model, the holdout is the sample's tail of distinct
+        // records which aren't trained on
+        NN::TrainResult train_result;
+
+        if (replay_buffer.is_prioritized())
+        {
+            replay_buffer.select_batch(inputs, mcts, results, trajectories, indices, weights, holdout, stamps);
+            train_result = cmodel.train(trajectories, inputs, mcts, results, detect_anomaly, weights, losses, holdout);
+            replay_buffer.update_priorities(indices, stamps, losses, trajectories - holdout);
+        }
+        else
+        {
+            replay_buffer.select_batch(inputs, mcts, results, trajectories, nullptr, nullptr, holdout);
+            train_result = cmodel.train(trajectories, inputs, mcts, results, detect_anomaly, nullptr, nullptr, holdout);
+        }
+
+        if (scheduler.enabled())
+            scheduler.settle(consumption, (long) (trajectories - holdout) * train_result.epochs);
 
-        bool eval_result;
+        bool eval_result = false;
 
-        try {
-            eval_result = eval(model, &cmodel, id);
-        } catch (exception& e)
+        if (!train_result.improved())
         {
-            cerr << "TRAIN " << id << ": evaluation failed: " << e.what() << endl;
-            eval_result = false;
+            // No better than the current model on unseen positions, don't
+            // spend a match on it
+            cout << "TRAIN " << id << ": candidate did not improve validation loss (policy "
+                 << train_result.initial_policy_loss << ", value " << train_result.initial_value_loss
+                 << "), skipping evaluation" << endl;
+        }
+        else
+        {
+            SearchStats eval_stats;
+
+            try {
+                eval_result = eval(model, &cmodel, id, &eval_stats);
+            } catch (exception& e)
+            {
+                cerr << "TRAIN " << id << ": evaluation failed: " << e.what() << endl;
+                eval_result = false;
+            }
+
+            lock_guard<mutex> lock(search_lock);
+            eval_totals = eval_stats;
         }
 
         // Evaluate new model
@@ -300,5 +983,13 @@ void Selfplay::training_main(int id)
         target_count += target_incr;
     }
 
+    delete[] inputs;
+    delete[] mcts;
+    delete[] results;
+    delete[] indices;
+    delete[] stamps;
+    delete[] weights;
+    delete[] losses;
+
     cout << "TRAIN " << id << ": stopping thread" << endl;
 }
@@ -1,10 +1,17 @@
 #pragma once
 
+#include "inferenceserver.h"
+#include "mcts.h"
 #include "nn/nn.h"
 #include "replaybuffer.h"
+#include "scheduler.h"
 
 #include <atomic>
 #include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <shared_mutex>
 #include <string>
@@ -21,9 +28,44 @@
 
 namespace kami {
 
+// Coroutine selfplay (gamedriver.h, C++20)
+class GameTask;
+class InferenceBatcher;
+struct CoroutineGame;
+
+// A game in progress, which can move between inference threads
+struct SelfplayGame;
+
 class Selfplay {
     public:
         Selfplay(NN* model);
+        ~Selfplay();
+
+        // A finished game's training samples
+        struct Sample {
+            std::vector<float> inputs, mcts;
+            float result;
+            uint64_t key;
+            int visits;
+
+            // Actions from the initial position, kept for reanalysis
+            std::vector<int> moves;
+        };
+
+        typedef std::function<void(std::vector<Sample>& game)> GameSink;
+
+        /**
+         * Send finished games to `sink` instead of the local replay buffer,
+         * e.g. to upload them to a remote learner. Set before start().
+         */
+        void set_game_sink(GameSink sink) { game_sink = sink; }
+
+        /**
+         * Run inference on a shared inference server instead of the local
+         * model. Each inference thread holds one slot of `client` and builds
+         * its batches directly in shared memory. Set before start().
+         */
+        void set_inference_client(InferenceClient* client) { inference_client = client; }
 
         /**
          * Start the training loop.
@@ -35,6 +77,27 @@ class Selfplay {
          */
         void stop();
 
+        /**
+         * Resizes selfplay while running. Games of a removed worker, or left
+         * over after shrinking the batch, are parked and resumed by the next
+         * worker with room, so no search or trajectory is lost.
+         *
+         * add_workers() and remove_workers() return once the workers have
+         * started or exited. set_batch() returns at once: each worker adopts
+         * the new size, parking or adopting games, at its next batch
+         * boundary, so get_parked_games() catches up shortly after.
+         *
+         * Not available with selfplay_coroutines, whose games live in their
+         * coroutine frames.
+         */
+        void add_workers(int n);
+        void remove_workers(int n);
+        void set_batch(int batch);
+
+        int get_workers();
+        int get_batch() { return ibatch; }
+        int get_parked_games();
+
         // Status reportingl->infer
         enum StatusCode {
             STOPPED,
@@ -69,6 +132,31 @@ class Selfplay {
 
         Status status;
         ReplayBuffer& get_rbuf() { return replay_buffer; }
+        RateScheduler& get_scheduler() { return scheduler; }
+
+        // Memory accounting across trees, trajectories, replay buffer and model
+        struct MemoryUsage {
+            long tree_nodes = 0;
+            size_t tree_bytes = 0;
+            size_t trajectory_bytes = 0;
+            size_t replay_bytes = 0;
+            size_t weight_bytes = 0;
+            size_t activation_bytes = 0;
+        };
+
+        MemoryUsage memory_usage();
+
+        // Search statistics over every selfplay move, and over the moves of
+        // the last evaluation
+        SearchStats search_stats() {
+            std::lock_guard<std::mutex> lock(search_lock);
+            return search_totals;
+        }
+
+        SearchStats eval_search_stats() {
+            std::lock_guard<std::mutex> lock(search_lock);
+            return eval_totals;
+        }
 
         std::string get_next_pgn() {
             wants_pgn = true;
@@ -80,24 +168,82 @@ class Selfplay {
         }
 
     private:
-        std::vector<std::thread> inference;
         std::vector<std::thread> training;
+        std::vector<std::thread> reanalysis;
 
         NN* model;
 
         ReplayBuffer replay_buffer;
 
-        int ibatch;
+        // Samples drawn per training round, and the actor/learner balance
+        int trajectories;
+        RateScheduler scheduler;
+
+        // Games per inference thread, read by the workers every batch
+        std::atomic<int> ibatch;
         int nodes;
 
+        GameSink game_sink;
+        InferenceClient* inference_client = nullptr;
+
         std::atomic<bool> wants_pgn;
         std::string ret_pgn;
 
-        std::list<std::atomic<int>> partial_trajectories;
-        std::mutex partial_trajectories_lock;
+        // An inference thread, with counters published once per batch
+        struct Worker {
+            int id;
+            std::thread thread;
+            std::atomic<bool> retire{false};
+
+            std::atomic<int> partials{0};
+            std::atomic<long> tree_nodes{0};
+            std::atomic<size_t> tree_bytes{0};
+            std::atomic<size_t> trajectory_bytes{0};
+        };
+
+        std::list<Worker> workers;
+        std::mutex workers_lock;
+        int next_worker = 0;
+
+        // Games waiting for a worker
+        std::deque<std::unique_ptr<SelfplayGame>> parked;
+        std::mutex parked_lock;
+
+        std::mutex search_lock;
+        SearchStats search_totals, eval_totals;
 
-        void inference_main(int id);
+        void inference_main(Worker* worker);
         void training_main(int id);
 
+        // Re-searches stored positions with the current model and replaces
+        // their policy targets
+        void reanalysis_main(int id);
+
+        // Selfplay with many suspended games per thread, see gamedriver.h
+        void coroutine_main(Worker* worker);
+        GameTask play_game(CoroutineGame& game, InferenceBatcher& batcher);
+
+        // Model generation used for search, local or on the inference server
+        int current_generation() {
+            return inference_client ? inference_client->get_generation() : model->get_generation();
+        }
+
+        // Send a finished game to the sink or the replay buffer
+        void emit_game(std::vector<Sample>& game);
+
+        // Seeds of finished games: "seed generation plies result" per line,
+        // enough to replay any game with MCTS::seed()
+        std::ofstream seed_log;
+        std::mutex seed_log_lock;
+
+        // Logs a finished game's seed, and hands it to get_next_pgn() if asked
+        void record_game(MCTS& tree);
+
+        // Start an inference thread, must hold workers_lock
+        void spawn_worker();
+
+        // Park or adopt games until a worker holds `n`
+        void balance_games(std::vector<std::unique_ptr<SelfplayGame>>& games, int n);
+
 }; // class Selfplay
 } // namespace kami
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+namespace kami {
+
+/**
+ * Binary sum-tree over a fixed number of leaf priorities, used for
+ * prioritized sampling. Leaves can be updated concurrently without a lock:
+ * each update swaps the leaf value and adds the difference to every ancestor.
+ * Sampling concurrent with updates sees an approximately consistent tree.
+ */
+class SumTree {
+    public:
+        SumTree(int capacity) : capacity(capacity)
+        {
+            for (leaves = 1; leaves < capacity; leaves *= 2);
+
+            nodes = new std::atomic<double>[2 * leaves];
+
+            for (int i = 0; i < 2 * leaves; ++i)
+                nodes[i] = 0.0;
+        }
+
+        ~SumTree() { delete[] nodes; }
+
+        void set(int index, double priority)
+        {
+            int i = leaves + index;
+            double delta = priority - nodes[i].exchange(priority);
+
+            for (i /= 2; i >= 1; i /= 2)
+            {
+                double cur = nodes[i].load();
+                while (!nodes[i].compare_exchange_weak(cur, cur + delta));
+            }
+        }
+
+        double get(int index) { return nodes[leaves + index]; }
+        double total() { return nodes[1]; }
+
+        void clear()
+        {
+            for (int i = 0; i < 2 * leaves; ++i)
+                nodes[i] = 0.0;
+        }
+
+        /**
+         * Finds the leaf at which the running sum of priorities passes `mass`.
+         */
+        int find(double mass)
+        {
+            int i = 1;
+
+            while (i < leaves)
+            {
+                double left = nodes[2 * i];
+
+                if (mass < left)
+                    i = 2 * i;
+                else
+                {
+                    mass -= left;
+                    i = 2 * i + 1;
+                }
+            }
+
+            // Concurrent updates can leave the mass slightly past the last leaf
+            return std::min(i - leaves, capacity - 1);
+        }
+
+    private:
+        int capacity, leaves;
+        std::atomic<double>* nodes;
+}; // class SumTree
+} // namespace kami
@@ -0,0 +1,164 @@
+#include "../kami/coordinator.h"
+#include "../kami/env.h"
+#include "../kami/nn/nn.h"
+#include "../kami/options.h"
+#include "../kami/replaybuffer.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace kami;
+using namespace std;
+
+// Coordinator protocol test on localhost.
+//
+// Starts a coordinator on a unix socket, then spawns worker processes (this
+// binary re-executed with "worker") which connect, fetch weights twice
+// (the second fetch must be served from cache), upload games in two batches
+// and report throughput. The learner checks every sample arrived. Finally a
+// worker keeps queueing games after the coordinator has stopped, and its
+// queue must stay within coordinator_max_pending.
+
+#define WORKERS 3
+#define GAMES 4 // per upload, two uploads per worker
+#define GAME_LENGTH 5
+#define MAX_PENDING 8
+
+static const string addr = "unix:/tmp/__kami_coordinator_test.sock";
+
+static vector<Selfplay::Sample> make_game()
+{
+    vector<Selfplay::Sample> game;
+
+    for (int i = 0; i < GAME_LENGTH; ++i)
+    {
+        Selfplay::Sample s;
+
+        s.inputs.assign(OBSIZE, 1.0f);
+        s.mcts.assign(PSIZE, 0.0f);
+        s.mcts[i] = 1.0f;
+        s.result = 1.0f;
+        s.key = 0;
+        s.visits = 1;
+
+        game.push_back(s);
+    }
+
+    return game;
+}
+
+static int worker_main(int index)
+{
+    NN model(8, 8, NFEATURES, PSIZE, true);
+    CoordinatorClient client(addr, "test-worker-" + to_string(index));
+
+    if (!client.fetch_weights(&model))
+    {
+        cerr << "worker " << index << ": first fetch didn't load weights" << endl;
+        return 1;
+    }
+
+    if (client.fetch_weights(&model))
+    {
+        cerr << "worker " << index << ": second fetch wasn't served from cache" << endl;
+        return 1;
+    }
+
+    for (int upload = 0; upload < 2; ++upload)
+    {
+        vector<vector<Selfplay::Sample>> games(GAMES, make_game());
+
+        client.upload(games);
+    }
+
+    client.report(2 * GAMES, 2 * GAMES * GAME_LENGTH, 1.0f);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    // Keep the model small, weights are shipped to every worker
+    options::setInt("filters", 8);
+    options::setInt("residuals", 1);
+
+    if (argc > 2 && string(argv[1]) == "worker")
+        return worker_main(stoi(argv[2]));
+
+    NN model(8, 8, NFEATURES, PSIZE, true);
+    ReplayBuffer rbuf(OBSIZE, PSIZE, 1024);
+    Coordinator coordinator(&model, &rbuf, addr);
+
+    coordinator.start();
+
+    vector<pid_t> children;
+
+    for (int i = 0; i < WORKERS; ++i)
+    {
+        pid_t pid = fork();
+
+        if (!pid)
+        {
+            string index = to_string(i);
+            execl(argv[0], argv[0], "worker", index.c_str(), (char*) nullptr);
+            _exit(127);
+        }
+
+        children.push_back(pid);
+    }
+
+    int failed = 0;
+
+    for (pid_t pid : children)
+    {
+        int status;
+        waitpid(pid, &status, 0);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            ++failed;
+    }
+
+    // Connected before the coordinator goes away, then left queueing games
+    options::setInt("coordinator_max_pending", MAX_PENDING);
+    CoordinatorClient offline(addr, "test-offline");
+
+    cout << coordinator.report();
+    coordinator.stop();
+
+    int max_queued = 0;
+
+    for (int i = 0; i < 4 * MAX_PENDING; ++i)
+    {
+        vector<Selfplay::Sample> game = make_game();
+        offline.queue(game);
+
+        max_queued = max(max_queued, offline.pending_games());
+    }
+
+    long expected = WORKERS * 2 * GAMES * GAME_LENGTH;
+
+    if (failed)
+    {
+        cerr << "FAIL: " << failed << " worker(s) failed" << endl;
+        return 1;
+    }
+
+    if (max_queued > MAX_PENDING || offline.dropped_games() != 3 * MAX_PENDING)
+    {
+        cerr << "FAIL: offline worker queued up to " << max_queued << " games (limit " << MAX_PENDING
+             << "), dropped " << offline.dropped_games() << endl;
+        return 1;
+    }
+
+    if (rbuf.count() != expected)
+    {
+        cerr << "FAIL: expected " << expected << " samples, received " << rbuf.count() << endl;
+        return 1;
+    }
+
+    cout << "PASS: " << WORKERS << " workers uploaded " << rbuf.count() << " samples, offline queue held at " << max_queued << " games" << endl;
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "../kami/env.h"
+#include "../kami/inferenceserver.h"
+#include "../kami/nn/nn.h"
+#include "../kami/options.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace kami;
+using namespace std;
+
+// Shared inference server test on localhost.
+//
+// Starts a server on a unix socket, then spawns client processes (this binary
+// re-executed with "client") which each run several threads submitting
+// batches of varying size. Every client loads the server's weights and checks
+// the served policies and values against its own local inference.
+
+#define CLIENTS 3
+#define THREADS 2 // per client, one slot each
+#define SLOT_BATCH 8
+#define REQUESTS 20 // per thread
+
+static const string addr = "unix:/tmp/__kami_inference_test.sock";
+static const string weights = "/tmp/__kami_inference_test.pt";
+
+static int client_main(int index)
+{
+    NN model(8, 8, NFEATURES, PSIZE, true);
+    model.read(weights);
+
+    InferenceClient client(addr, THREADS, SLOT_BATCH);
+
+    vector<thread> threads;
+    atomic<int> failed(0);
+
+    for (int t = 0; t < THREADS; ++t)
+    {
+        threads.push_back(thread([&, t]() {
+            mt19937 rng(index * THREADS + t);
+            uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+            vector<float> inputs(SLOT_BATCH * OBSIZE);
+            vector<float> policy(SLOT_BATCH * PSIZE), value(SLOT_BATCH);
+            vector<float> lpolicy(SLOT_BATCH * PSIZE), lvalue(SLOT_BATCH);
+
+            for (int r = 0; r < REQUESTS; ++r)
+            {
+                int batch = 1 + rng() % SLOT_BATCH;
+
+                for (int i = 0; i < batch * OBSIZE; ++i)
+                    inputs[i] = dist(rng) < 0.1f;
+
+                // Alternate between the copying and zero-copy interfaces
+                if (r % 2)
+                    client.infer(inputs.data(), batch, policy.data(), value.data());
+                else
+                {
+                    int slot = client.acquire();
+
+                    memcpy(client.inputs(slot), inputs.data(), sizeof(float) * batch * OBSIZE);
+                    client.submit(slot, batch);
+                    client.wait(slot);
+                    memcpy(policy.data(), client.policy(slot), sizeof(float) * batch * PSIZE);
+                    memcpy(value.data(), client.value(slot), sizeof(float) * batch);
+
+                    client.release(slot);
+                }
+
+                model.infer(inputs.data(), batch, lpolicy.data(), lvalue.data());
+
+                float err = 0.0f;
+
+                for (int i = 0; i < batch * PSIZE; ++i)
+                    err = max(err, fabs(policy[i] - lpolicy[i]));
+
+                for (int i = 0; i < batch; ++i)
+                    err = max(err, fabs(value[i] - lvalue[i]));
+
+                if (err > 1e-4f)
+                {
+                    cerr << "client " << index << " thread " << t << ": request " << r << " differs from local inference by " << err << endl;
+                    ++failed;
+                }
+            }
+        }));
+    }
+
+    for (auto& t : threads)
+        t.join();
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    options::setInt("filters", 8);
+    options::setInt("residuals", 1);
+
+    if (argc > 2 && string(argv[1]) == "client")
+        return client_main(stoi(argv[2]));
+
+    NN model(8, 8, NFEATURES, PSIZE, true);
+    model.write(weights);
+
+    // A long wait so requests from different clients get merged
+    InferenceServer server(&model, addr, CLIENTS * THREADS * SLOT_BATCH, 2000);
+    server.start();
+
+    vector<pid_t> children;
+
+    for (int i = 0; i < CLIENTS; ++i)
+    {
+        pid_t pid = fork();
+
+        if (!pid)
+        {
+            string index = to_string(i);
+            execl(argv[0], argv[0], "client", index.c_str(), (char*) nullptr);
+            _exit(127);
+        }
+
+        children.push_back(pid);
+    }
+
+    int failed = 0;
+
+    for (pid_t pid : children)
+    {
+        int status;
+        waitpid(pid, &status, 0);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            ++failed;
+    }
+
+    cout << server.report();
+    server.stop();
+
+    unlink(weights.c_str());
+
+    if (failed)
+    {
+        cerr << "FAIL: " << failed << " client(s) failed" << endl;
+        return 1;
+    }
+
+    cout << "PASS: " << CLIENTS << " clients served by one model" << endl;
+    return 0;
+}
@@ -53,10 +53,10 @@ int main()
 
             cout << "";
 */
-            float policy[4096 + 4 * 22];
+            float policy[PSIZE];
             float p = 1.0f / (float) tree.get_env().actions().size();
 
-            for (int i = 0; i < 4096 + 4 * 22; ++i)
+            for (int i = 0; i < PSIZE; ++i)
                 policy[i] = p;
 
             double value = (((double) rand() / (double) RAND_MAX) * 2.0 - 1.0);
@@ -64,15 +64,14 @@ int main()
             tree.expand(policy, value);
         }
 
-        std::sort(tree.root->children.begin(), tree.root->children.end(), [](Node* lhs, Node* rhs) { return lhs->n > rhs->n; });
-
-        for (auto& n : tree.root->children) {
-            cout << n->debug(&tree.get_env()) << "\n";
-        }
+        cout << tree.dump();
+        cout << "pv: " << tree.pv() << "\n";
 
         int action = tree.pick();
         cout << "picking move " << tree.get_env().debug_action(action) << "\n";
         tree.push(action);
+
+        cout << tree.last_search_stats().report();
     }
 
     cout << desc << ", " << value << "\n";
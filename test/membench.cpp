@@ -0,0 +1,140 @@
+#include "../kami/env.h"
+#include "../kami/mcts.h"
+#include "../kami/nn/nn.h"
+#include "../kami/options.h"
+#include "../kami/replaybuffer.h"
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace kami;
+using namespace std;
+
+// Memory footprint benchmark.
+//
+// Measures resident memory against MCTS tree size, replay buffer size and
+// model size, next to the byte counts reported by the accounting in MCTS,
+// ReplayBuffer and NN. RSS figures are deltas from the RSS before each
+// allocation, peak is the process high water mark.
+
+// Reads a field in kB from /proc/self/status, returns bytes
+static long proc_status(string field)
+{
+    ifstream status("/proc/self/status");
+    string line;
+
+    while (getline(status, line))
+        if (line.rfind(field + ":", 0) == 0)
+            return stol(line.substr(field.size() + 1)) * 1024;
+
+    return 0;
+}
+
+static long rss() { return proc_status("VmRSS"); }
+static long peak_rss() { return proc_status("VmHWM"); }
+
+static string mb(double bytes)
+{
+    stringstream out;
+    out << fixed << setprecision(2) << bytes / (1024.0 * 1024.0) << " MB";
+    return out.str();
+}
+
+int main(int argc, char** argv)
+{
+    try {
+        options::load();
+    } catch (exception& e) {
+        cerr << "WARNING: " << e.what() << endl;
+    }
+
+    float obs[OBSIZE];
+    float* policy = new float[PSIZE];
+
+    for (int i = 0; i < PSIZE; ++i)
+        policy[i] = 1.0f / PSIZE;
+
+    // The top-k pending list and the rescoring generation are only
+    // allocated for expanded nodes, leaves carry a null pointer
+    cout << "Tree size (accounted " << MCTS::node_bytes << " bytes/node, "
+         << MCTS::expansion_bytes << " more per expanded node)" << endl;
+
+    for (int nodes = 1024; nodes <= 65536; nodes *= 4)
+    {
+        long before = rss();
+
+        MCTS tree;
+
+        while (tree.n() < nodes)
+            if (tree.select(obs))
+                tree.expand(policy, 0.0f);
+
+        long delta = rss() - before;
+
+        cout << setw(8) << nodes << " visits: "
+             << setw(9) << tree.nodes() << " nodes, accounted " << setw(10) << mb(tree.bytes())
+             << ", RSS +" << setw(10) << mb(delta)
+             << " (" << (double) delta / tree.nodes() << " bytes/node)"
+             << ", peak " << mb(peak_rss()) << endl;
+
+        size_t expansion_total = MCTS::expansion_bytes * tree.expansions();
+
+        cout << setw(8) << "" << "  expansion records " << mb(expansion_total)
+             << " (" << 100.0 * expansion_total / tree.bytes() << "% of tree) for "
+             << tree.expansions() << " expanded nodes (" << 100.0 * tree.expansions() / tree.nodes() << "%)" << endl;
+    }
+
+    cout << "Replay buffer size" << endl;
+
+    for (int size = 1024; size <= 65536; size *= 4)
+    {
+        long before = rss();
+
+        ReplayBuffer rbuf(OBSIZE, PSIZE, size);
+
+        // Touch every slot so the buffer is resident
+        for (int i = 0; i < size; ++i)
+            rbuf.add(obs, policy, 0.0f);
+
+        long delta = rss() - before;
+
+        cout << setw(8) << size << " samples: accounted " << setw(10) << mb(rbuf.bytes())
+             << ", RSS +" << setw(10) << mb(delta)
+             << ", peak " << mb(peak_rss()) << endl;
+    }
+
+    cout << "Model" << endl;
+
+    {
+        long before = rss();
+
+        NN model(8, 8, NFEATURES, PSIZE, true);
+
+        long weights_delta = rss() - before;
+        int batch = options::getInt("selfplay_batch", 16);
+
+        float* inputs = new float[batch * OBSIZE];
+        float* inf_policy = new float[batch * PSIZE];
+        float* inf_value = new float[batch];
+
+        memset(inputs, 0, sizeof(float) * batch * OBSIZE);
+
+        long peak_before = peak_rss();
+        model.infer(inputs, batch, inf_policy, inf_value);
+
+        cout << "weights: accounted " << mb(model.weight_bytes()) << ", RSS +" << mb(weights_delta) << endl;
+        cout << "activations (batch " << batch << "): estimated " << mb(model.activation_bytes(batch))
+             << ", peak +" << mb(peak_rss() - peak_before) << endl;
+
+        delete[] inputs;
+        delete[] inf_policy;
+        delete[] inf_value;
+    }
+
+    delete[] policy;
+
+    return 0;
+}
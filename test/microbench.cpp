@@ -0,0 +1,558 @@
+#include "../kami/env.h"
+#include "../kami/mcts.h"
+#include "../kami/options.h"
+#include "../kami/random.h"
+#include "../kami/replaybuffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace kami;
+using namespace std;
+
+// Component microbenchmarks for Env, MCTS and ReplayBuffer.
+//
+//   microbench [-o results.json] [-b baseline.json] [-t threshold_pct] [-r reps] [-s seed]
+//
+// Each benchmark is warmed up, then timed over several repetitions. Results
+// are reported in nanoseconds per operation. With a baseline, benchmarks whose
+// median is more than the threshold slower are flagged and the exit status is
+// nonzero.
+
+typedef chrono::steady_clock Clock;
+
+struct Stats {
+    double mean, median, stddev, min;
+};
+
+static int warmup = 3;
+static int reps = 15;
+
+// Results are accumulated here so the benchmarked calls aren't optimized out
+static volatile long sink;
+
+static Stats measure(function<double()> sample)
+{
+    vector<double> samples;
+
+    for (int i = 0; i < warmup; ++i)
+        sample();
+
+    for (int i = 0; i < reps; ++i)
+        samples.push_back(sample());
+
+    sort(samples.begin(), samples.end());
+
+    Stats s;
+    double total = 0.0, sq = 0.0;
+
+    for (double v : samples)
+        total += v;
+
+    s.mean = total / samples.size();
+
+    for (double v : samples)
+        sq += (v - s.mean) * (v - s.mean);
+
+    s.stddev = sqrt(sq / samples.size());
+    s.median = samples[samples.size() / 2];
+    s.min = samples[0];
+
+    return s;
+}
+
+static double elapsed_ns(Clock::time_point since)
+{
+    return chrono::duration<double, nano>(Clock::now() - since).count();
+}
+
+// Builds a corpus of positions by random playouts from the start position,
+// keeping the action sequence leading to every few plies.
+static vector<vector<int>> build_corpus(unsigned seed, int games, int stride)
+{
+    vector<vector<int>> corpus;
+    mt19937 rng(seed);
+
+    for (int g = 0; g < games; ++g)
+    {
+        Env e;
+        vector<int> line;
+        float value;
+
+        while (!e.terminal(&value))
+        {
+            if (line.size() % stride == 0)
+                corpus.push_back(line);
+
+            vector<int>& actions = e.actions();
+            int action = actions[rng() % actions.size()];
+
+            e.push(action);
+            line.push_back(action);
+        }
+    }
+
+    return corpus;
+}
+
+// Env instances for the corpus (Env is large, keep them on the heap)
+static vector<unique_ptr<Env>> make_envs(vector<vector<int>>& corpus)
+{
+    vector<unique_ptr<Env>> envs;
+
+    for (auto& line : corpus)
+    {
+        envs.emplace_back(new Env());
+
+        for (int a : line)
+            envs.back()->push(a);
+    }
+
+    return envs;
+}
+
+// Searches a tree with a flat policy and a fixed value until it has at least
+// `nodes` visits.
+static void search(MCTS& tree, int nodes, float* obs, float* policy)
+{
+    while (tree.n() < nodes)
+    {
+        if (tree.select(obs))
+            tree.expand(policy, 0.0f);
+    }
+}
+
+static map<string, double> read_baseline(string path)
+{
+    // Expects the format written by write_results(): one benchmark per line
+    map<string, double> out;
+    ifstream file(path);
+
+    if (!file)
+        throw runtime_error("couldn't open baseline " + path);
+
+    string line;
+
+    while (getline(file, line))
+    {
+        size_t name_start = line.find('"');
+        size_t name_end = line.find('"', name_start + 1);
+        size_t median = line.find("\"median\":");
+
+        if (name_start == string::npos || name_end == string::npos || median == string::npos)
+            continue;
+
+        out[line.substr(name_start + 1, name_end - name_start - 1)] = stod(line.substr(median + 9));
+    }
+
+    return out;
+}
+
+static void write_results(string path, vector<pair<string, Stats>>& results)
+{
+    ofstream file(path);
+
+    if (!file)
+        throw runtime_error("couldn't open " + path + " for writing");
+
+    file << "{" << endl;
+
+    for (int i = 0; i < (int) results.size(); ++i)
+    {
+        Stats& s = results[i].second;
+
+        file << "  \"" << results[i].first << "\": {"
+             << "\"mean\": " << s.mean
+             << ", \"median\": " << s.median
+             << ", \"stddev\": " << s.stddev
+             << ", \"min\": " << s.min
+             << "}" << (i + 1 < (int) results.size() ? "," : "") << endl;
+    }
+
+    file << "}" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    string output, baseline;
+    float threshold = 10.0f;
+    unsigned seed = 1;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string flag = argv[i];
+
+        if (flag == "-o") output = argv[i + 1];
+        else if (flag == "-b") baseline = argv[i + 1];
+        else if (flag == "-t") threshold = stof(argv[i + 1]);
+        else if (flag == "-r") reps = stoi(argv[i + 1]);
+        else if (flag == "-s") seed = stoul(argv[i + 1]);
+        else
+        {
+            cerr << "unknown flag " << flag << endl;
+            return 1;
+        }
+    }
+
+    seed_streams(seed);
+
+    vector<vector<int>> corpus = build_corpus(seed, 16, 4);
+    vector<unique_ptr<Env>> envs = make_envs(corpus);
+    vector<int> first_action;
+
+    // Nonterminal positions only, with an action to push/pop
+    for (int i = 0; i < (int) envs.size(); ++i)
+        first_action.push_back(envs[i]->actions()[0]);
+
+    cout << "Corpus: " << corpus.size() << " positions" << endl;
+
+    float obs[OBSIZE];
+    float* policy = new float[PSIZE];
+
+    for (int i = 0; i < PSIZE; ++i)
+        policy[i] = 1.0f / PSIZE;
+
+    vector<pair<string, Stats>> results;
+
+    auto bench = [&](string name, function<double()> sample) {
+        results.push_back({ name, measure(sample) });
+    };
+
+    // Env benchmarks run over the whole corpus per sample
+
+    bench("env.encode", [&]() {
+        long ops = 0;
+        auto start = Clock::now();
+
+        for (auto& e : envs)
+        {
+            for (int a : e->actions())
+            {
+                sink = sink + e->encode(e->decode(a));
+                ++ops;
+            }
+        }
+
+        return elapsed_ns(start) / ops;
+    });
+
+    bench("env.decode", [&]() {
+        long ops = 0;
+        auto start = Clock::now();
+
+        for (auto& e : envs)
+        {
+            for (int a : e->actions())
+            {
+                sink = sink + e->decode(a);
+                ++ops;
+            }
+        }
+
+        return elapsed_ns(start) / ops;
+    });
+
+    bench("env.observe", [&]() {
+        auto start = Clock::now();
+
+        for (auto& e : envs)
+            e->observe(obs);
+
+        return elapsed_ns(start) / envs.size();
+    });
+
+    // push/pop of a legal action, also used to invalidate cached actions below
+    bench("env.push_pop", [&]() {
+        long ops = 0;
+        auto start = Clock::now();
+
+        for (int i = 0; i < (int) envs.size(); ++i)
+        {
+            Env* e = envs[i].get();
+
+            e->push(first_action[i]);
+            e->pop();
+            ++ops;
+        }
+
+        return elapsed_ns(start) / ops;
+    });
+
+    // actions and terminal are measured on freshly pushed positions, as in
+    // MCTS::select, so the cost includes one push_pop
+    bench("env.actions", [&]() {
+        long ops = 0;
+        auto start = Clock::now();
+
+        for (int i = 0; i < (int) envs.size(); ++i)
+        {
+            Env* e = envs[i].get();
+
+            e->push(first_action[i]);
+            sink = sink + e->actions().size();
+            e->pop();
+            ++ops;
+        }
+
+        return elapsed_ns(start) / ops;
+    });
+
+    bench("env.terminal", [&]() {
+        long ops = 0;
+        float value;
+        auto start = Clock::now();
+
+        for (int i = 0; i < (int) envs.size(); ++i)
+        {
+            Env* e = envs[i].get();
+
+            e->push(first_action[i]);
+            sink = sink + e->terminal(&value);
+            e->pop();
+            ++ops;
+        }
+
+        return elapsed_ns(start) / ops;
+    });
+
+    // MCTS benchmarks: select and expand are timed separately over a search
+    // from sampled corpus positions
+
+    const int nodes = 256;
+    double select_ns = 0, expand_ns = 0;
+    long selects = 0, expands = 0;
+
+    auto search_timed = [&](int index) {
+        MCTS tree;
+
+        // Walk the tree down to the corpus position, expanding as needed
+        for (int a : corpus[index])
+        {
+            if (tree.root->children.empty() && tree.select(obs))
+                tree.expand(policy, 0.0f);
+
+            tree.push(a);
+        }
+
+        while (tree.n() < nodes)
+        {
+            auto start = Clock::now();
+            bool needs_eval = tree.select(obs);
+            select_ns += elapsed_ns(start);
+            ++selects;
+
+            if (!needs_eval)
+                continue;
+
+            start = Clock::now();
+            tree.expand(policy, 0.0f);
+            expand_ns += elapsed_ns(start);
+            ++expands;
+        }
+    };
+
+    int search_index = 0;
+
+    bench("mcts.select", [&]() {
+        select_ns = 0;
+        selects = 0;
+        search_timed(search_index++ % corpus.size());
+        return select_ns / selects;
+    });
+
+    bench("mcts.expand", [&]() {
+        expand_ns = 0;
+        expands = 0;
+        search_timed(search_index++ % corpus.size());
+        return expand_ns / expands;
+    });
+
+    bench("mcts.push", [&]() {
+        MCTS tree;
+        search(tree, nodes, obs, policy);
+
+        auto start = Clock::now();
+        tree.push(tree.pick());
+        return elapsed_ns(start);
+    });
+
+    MCTS searched;
+    search(searched, nodes * 4, obs, policy);
+
+    bench("mcts.pick", [&]() {
+        const int iters = 1000;
+        auto start = Clock::now();
+
+        for (int i = 0; i < iters; ++i)
+            sink = sink + searched.pick(1.0f);
+
+        return elapsed_ns(start) / iters;
+    });
+
+    bench("mcts.snapshot", [&]() {
+        const int iters = 1000;
+        auto start = Clock::now();
+
+        for (int i = 0; i < iters; ++i)
+            searched.snapshot(policy);
+
+        // snapshot overwrites the flat policy, restore it
+        for (int j = 0; j < PSIZE; ++j)
+            policy[j] = 1.0f / PSIZE;
+
+        return elapsed_ns(start) / iters;
+    });
+
+    // One search per specialization of the MCTS hot paths, picked through
+    // the options as at startup. Named by the traits enabled: f(orce expand
+    // unvisited), s(cale cpuct), b(ootstrap), n(oise).
+    vector<pair<string, string>> variants;
+
+    int saved_force_expand = options::getInt("force_expand_unvisited", 0);
+    int saved_scale_cpuct = options::getInt("scale_cpuct_by_actions", 0);
+    int saved_bootstrap = options::getInt("bootstrap_weight", 0);
+    float saved_noise = options::getFloat("mcts_noise_weight", 0.05f);
+
+    for (int bits = 0; bits < 16; ++bits)
+    {
+        options::setInt("force_expand_unvisited", bits & 1);
+        options::setInt("scale_cpuct_by_actions", (bits >> 1) & 1);
+        options::setInt("bootstrap_weight", bits & 4 ? 25 : 0);
+        options::setFloat("mcts_noise_weight", bits & 8 ? 0.25f : 0.0f);
+
+        string name = string("mcts.sim.")
+            + "f" + to_string(bits & 1)
+            + "s" + to_string((bits >> 1) & 1)
+            + "b" + to_string((bits >> 2) & 1)
+            + "n" + to_string((bits >> 3) & 1);
+
+        variants.push_back({ name, MCTS().variant_name() });
+
+        // Nanoseconds per simulation
+        bench(name, [&]() {
+            MCTS tree;
+
+            auto start = Clock::now();
+            search(tree, nodes, obs, policy);
+            return elapsed_ns(start) / tree.n();
+        });
+    }
+
+    options::setInt("force_expand_unvisited", saved_force_expand);
+    options::setInt("scale_cpuct_by_actions", saved_scale_cpuct);
+    options::setInt("bootstrap_weight", saved_bootstrap);
+    options::setFloat("mcts_noise_weight", saved_noise);
+
+    // ReplayBuffer benchmarks
+
+    const int rbsize = 1024, rbatch = 64;
+    ReplayBuffer rbuf(OBSIZE, PSIZE, rbsize);
+
+    float* dst_inputs = new float[rbatch * OBSIZE];
+    float* dst_mcts = new float[rbatch * PSIZE];
+    float* dst_results = new float[rbatch];
+
+    envs[0]->observe(obs);
+
+    bench("replaybuffer.add", [&]() {
+        auto start = Clock::now();
+
+        for (int i = 0; i < rbsize; ++i)
+            rbuf.add(obs, policy, 0.0f);
+
+        return elapsed_ns(start) / rbsize;
+    });
+
+    bench("replaybuffer.select_batch", [&]() {
+        auto start = Clock::now();
+        rbuf.select_batch(dst_inputs, dst_mcts, dst_results, rbatch);
+        return elapsed_ns(start) / rbatch;
+    });
+
+    delete[] dst_inputs;
+    delete[] dst_mcts;
+    delete[] dst_results;
+    delete[] policy;
+
+    // Report
+
+    map<string, double> base;
+
+    if (baseline.size())
+        base = read_baseline(baseline);
+
+    int regressions = 0;
+
+    cout << left << setw(28) << "benchmark" << right
+         << setw(12) << "median ns"
+         << setw(12) << "mean ns"
+         << setw(12) << "stddev"
+         << setw(12) << "min ns";
+
+    if (base.size())
+        cout << setw(12) << "baseline" << setw(10) << "change";
+
+    cout << endl;
+
+    for (auto& r : results)
+    {
+        Stats& s = r.second;
+
+        cout << left << setw(28) << r.first << right << fixed << setprecision(1)
+             << setw(12) << s.median
+             << setw(12) << s.mean
+             << setw(12) << s.stddev
+             << setw(12) << s.min;
+
+        if (base.count(r.first))
+        {
+            double change = 100.0 * (s.median - base[r.first]) / base[r.first];
+
+            cout << setw(12) << base[r.first] << setw(9) << showpos << change << "%" << noshowpos;
+
+            if (change > threshold)
+            {
+                cout << "  REGRESSION";
+                ++regressions;
+            }
+        }
+
+        cout << endl;
+    }
+
+    cout << endl << "Simulations/s by MCTS variant:" << endl;
+
+    for (auto& v : variants)
+    {
+        for (auto& r : results)
+        {
+            if (r.first == v.first)
+                cout << left << setw(28) << v.first << right << setw(12) << (long) (1e9 / r.second.median) << "  " << v.second << endl;
+        }
+    }
+
+    if (output.size())
+    {
+        write_results(output, results);
+        cout << "Wrote results to " << output << endl;
+    }
+
+    if (regressions)
+    {
+        cout << regressions << " benchmark(s) regressed by more than " << threshold << "%" << endl;
+        return 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,212 @@
+#include "../kami/env.h"
+#include "../kami/mcts.h"
+#include "../kami/nn/nn.h"
+#include "../kami/options.h"
+#include "../kami/random.h"
+#include "../kami/replaybuffer.h"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace kami;
+using namespace std;
+
+// Selfplay throughput benchmark.
+//
+// Runs the same batched search loop as Selfplay::inference_main for a fixed
+// number of moves, with a pluggable evaluator in place of the network:
+//
+//   selfplaybench [uniform|random|nn] [moves] [seed]
+//
+// "uniform" returns a flat policy and a zero value, "random" a random policy
+// and value, "nn" runs a real NN (loaded from model_path if set). Reports
+// games/s, positions/s, evaluations/s and the time spent per simulation
+// outside of the evaluator.
+
+struct Evaluator {
+    virtual ~Evaluator() {}
+    virtual void infer(float* input, int batch, float* policy, float* value) = 0;
+};
+
+struct UniformEvaluator : public Evaluator {
+    void infer(float* input, int batch, float* policy, float* value)
+    {
+        for (int i = 0; i < batch * PSIZE; ++i)
+            policy[i] = 1.0f / PSIZE;
+
+        for (int i = 0; i < batch; ++i)
+            value[i] = 0.0f;
+    }
+};
+
+struct RandomEvaluator : public Evaluator {
+    mt19937 rng;
+
+    RandomEvaluator(unsigned seed) : rng(seed) {}
+
+    void infer(float* input, int batch, float* policy, float* value)
+    {
+        uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+        for (int b = 0; b < batch; ++b)
+        {
+            float total = 0.0f;
+
+            for (int i = 0; i < PSIZE; ++i)
+                total += (policy[b * PSIZE + i] = dist(rng));
+
+            for (int i = 0; i < PSIZE; ++i)
+                policy[b * PSIZE + i] /= total;
+
+            value[b] = dist(rng) * 2.0f - 1.0f;
+        }
+    }
+};
+
+struct NNEvaluator : public Evaluator {
+    NN model;
+
+    NNEvaluator() : model(8, 8, NFEATURES, PSIZE)
+    {
+        string modelpath = options::getStr("model_path");
+
+        if (modelpath.size())
+        {
+            try {
+                model.read(modelpath);
+            } catch (exception& e) {
+                cerr << "WARNING: model read from " << modelpath << " failed: " << e.what() << endl;
+            }
+        }
+    }
+
+    void infer(float* input, int batch, float* policy, float* value)
+    {
+        model.infer(input, batch, policy, value);
+    }
+};
+
+int main(int argc, char** argv)
+{
+    try {
+        options::load();
+    } catch (exception& e) {
+        cerr << "WARNING: " << e.what() << endl;
+    }
+
+    string mode = argc > 1 ? argv[1] : "uniform";
+    long target_moves = argc > 2 ? stol(argv[2]) : 2000;
+    unsigned seed = argc > 3 ? stoul(argv[3]) : 1;
+
+    int ibatch = options::getInt("selfplay_batch", 16);
+    int nodes = options::getInt("selfplay_nodes", 512);
+
+    unique_ptr<Evaluator> evaluator;
+
+    if (mode == "uniform")
+        evaluator.reset(new UniformEvaluator());
+    else if (mode == "random")
+        evaluator.reset(new RandomEvaluator(seed));
+    else if (mode == "nn")
+        evaluator.reset(new NNEvaluator());
+    else
+    {
+        cerr << "unknown evaluator \"" << mode << "\", expected uniform, random or nn" << endl;
+        return 1;
+    }
+
+    seed_streams(seed);
+
+    vector<MCTS> trees(ibatch);
+
+    for (int i = 0; i < ibatch; ++i)
+        trees[i].seed(seed + i);
+
+    // Trajectories are stored the same way selfplay does, so their cost is included
+    ReplayBuffer replay_buffer(OBSIZE, PSIZE, options::getInt("replaybuffer_size", 512));
+    vector<vector<float>> trajectories(ibatch);
+
+    // Side to move at each trajectory position, results are stored from its POV
+    vector<vector<float>> povs(ibatch);
+    float draw_value = (options::getInt("draw_value_pct", 50) / 100.0f) * 2.0f - 1.0f;
+
+    float* batch = new float[ibatch * OBSIZE];
+    float* inf_value = new float[ibatch];
+    float* inf_policy = new float[ibatch * PSIZE];
+
+    long moves = 0, games = 0, evaluations = 0, simulations = 0;
+    chrono::steady_clock::duration eval_time(0);
+
+    cout << "Running " << target_moves << " moves with " << mode << " evaluator, batch " << ibatch << ", " << nodes << " nodes, seed " << seed << endl;
+
+    auto start = chrono::steady_clock::now();
+
+    while (moves < target_moves)
+    {
+        for (int i = 0; i < ibatch; ++i)
+        {
+            while (trees[i].n() < nodes)
+            {
+                ++simulations;
+
+                if (trees[i].select(batch + i * OBSIZE))
+                    break;
+            }
+
+            if (trees[i].n() < nodes) continue;
+
+            vector<float>& traj = trajectories[i];
+
+            traj.resize(traj.size() + OBSIZE + PSIZE);
+            trees[i].get_env().observe(&traj[traj.size() - OBSIZE - PSIZE]);
+            trees[i].snapshot(&traj[traj.size() - PSIZE]);
+            povs[i].push_back(-trees[i].get_env().turn());
+
+            trees[i].push(trees[i].pick(1.0f));
+            ++moves;
+
+            float value;
+
+            if (trees[i].get_env().terminal(&value))
+            {
+                for (int t = 0, j = 0; t < (int) traj.size(); t += OBSIZE + PSIZE, ++j)
+                    replay_buffer.add(&traj[t], &traj[t + OBSIZE], value == 0.0f ? draw_value : povs[i][j] * value);
+
+                traj.clear();
+                povs[i].clear();
+                trees[i].reset();
+                ++games;
+            }
+
+            --i;
+        }
+
+        auto eval_start = chrono::steady_clock::now();
+        evaluator->infer(batch, ibatch, inf_policy, inf_value);
+        eval_time += chrono::steady_clock::now() - eval_start;
+
+        evaluations += ibatch;
+
+        for (int i = 0; i < ibatch; ++i)
+            trees[i].expand(inf_policy + i * PSIZE, inf_value[i]);
+    }
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double eval_secs = chrono::duration<double>(eval_time).count();
+
+    cout << "Elapsed: " << secs << " s (" << eval_secs << " s in evaluator)" << endl;
+    cout << "Games: " << games << ", " << games / secs << " games/s" << endl;
+    cout << "Positions: " << moves << ", " << moves / secs << " positions/s" << endl;
+    cout << "Evaluations: " << evaluations << ", " << evaluations / secs << " evaluations/s" << endl;
+    cout << "Simulations: " << simulations << ", " << (secs - eval_secs) * 1e6 / simulations << " us/simulation outside evaluator" << endl;
+
+    delete[] batch;
+    delete[] inf_value;
+    delete[] inf_policy;
+
+    return 0;
+}
@@ -0,0 +1,242 @@
+#include "../kami/env.h"
+#include "../kami/mcts.h"
+#include "../kami/nn/nn.h"
+#include "../kami/options.h"
+#include "../kami/selfplay.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace kami;
+using namespace std;
+
+// Network architecture sweep.
+//
+// Builds a grid of NNModule configurations (sweep_filters x sweep_residuals)
+// and measures for each: inference positions/s driving selfplay_batch MCTS
+// trees, training time, and policy/value loss on a held-out replay sample
+// produced by selfplay with the reference model. Prints the Pareto frontier
+// of throughput against held-out loss.
+
+struct Result {
+    int filters, residuals;
+    long params;
+    double pps, train_secs;
+    float policy_loss, value_loss;
+    bool pareto = false;
+
+    float loss() const { return policy_loss + value_loss; }
+};
+
+static vector<int> parse_list(string str)
+{
+    vector<int> out;
+    stringstream ss(str);
+    string item;
+
+    while (getline(ss, item, ','))
+        if (item.size())
+            out.push_back(stoi(item));
+
+    return out;
+}
+
+// Measure NN evaluations per second in selfplay conditions, i.e. with batches
+// gathered from concurrent MCTS trees.
+static double measure_throughput(NN& model, int batch, int nodes, int evals)
+{
+    vector<MCTS> trees(batch);
+
+    float* inputs = new float[batch * OBSIZE];
+    float* policy = new float[batch * PSIZE];
+    float* value = new float[batch];
+
+    int done = 0;
+    auto start = chrono::steady_clock::now();
+
+    while (done < evals)
+    {
+        for (int i = 0; i < batch; ++i)
+        {
+            while (trees[i].n() < nodes && !trees[i].select(inputs + i * OBSIZE));
+
+            if (trees[i].n() < nodes) continue;
+
+            trees[i].push(trees[i].pick());
+
+            float tvalue;
+
+            if (trees[i].get_env().terminal(&tvalue))
+                trees[i].reset();
+
+            --i;
+        }
+
+        model.infer(inputs, batch, policy, value);
+
+        for (int i = 0; i < batch; ++i)
+            trees[i].expand(policy + i * PSIZE, value[i]);
+
+        done += batch;
+    }
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    delete[] inputs;
+    delete[] policy;
+    delete[] value;
+
+    return done / secs;
+}
+
+int main(int argc, char** argv)
+{
+    try {
+        options::load();
+    } catch (exception& e) {
+        cerr << "WARNING: " << e.what() << endl;
+    }
+
+    vector<int> filters = parse_list(options::getStr("sweep_filters", "32,64,128"));
+    vector<int> residuals = parse_list(options::getStr("sweep_residuals", "1,2,4"));
+    int samples = options::getInt("sweep_samples", 2048);
+    int holdout = samples * options::getInt("sweep_holdout_pct", 20) / 100;
+    int evals = options::getInt("sweep_evals", 2048);
+    int batch = options::getInt("selfplay_batch", 16);
+    int nodes = options::getInt("selfplay_nodes", 512);
+
+    // Generate the replay sample with the reference model
+    options::setInt("replaybuffer_size", samples);
+    options::setInt("replaybuffer_dedup", 0);
+    options::setInt("training_threads", 0);
+
+    NN reference(8, 8, NFEATURES, PSIZE);
+    string modelpath = options::getStr("model_path");
+
+    if (modelpath.size())
+    {
+        try {
+            reference.read(modelpath);
+            cout << "Using reference model " << modelpath << endl;
+        } catch (exception& e) {
+            cerr << "WARNING: model read from " << modelpath << " failed: " << e.what() << endl;
+        }
+    }
+
+    Selfplay S(&reference);
+    S.start();
+
+    while (S.get_rbuf().count() < samples)
+    {
+        cout << "Generating replay sample: " << S.get_rbuf().count() << " / " << samples << endl;
+        this_thread::sleep_for(chrono::seconds(5));
+    }
+
+    S.stop();
+
+    // Contiguous split keeps most games entirely on one side
+    int ntrain = samples - holdout;
+
+    float* inputs = new float[samples * OBSIZE];
+    float* mcts = new float[samples * PSIZE];
+    float* results = new float[samples];
+
+    for (int i = 0; i < samples; ++i)
+        S.get_rbuf().get(i, inputs + i * OBSIZE, mcts + i * PSIZE, results + i);
+
+    vector<Result> results_table;
+
+    for (int f : filters)
+    {
+        for (int r : residuals)
+        {
+            Result res;
+
+            res.filters = f;
+            res.residuals = r;
+
+            options::setInt("filters", f);
+            options::setInt("residuals", r);
+
+            NN model(8, 8, NFEATURES, PSIZE);
+            res.params = model.parameter_count();
+
+            cout << "Sweeping filters=" << f << " residuals=" << r << " (" << res.params << " parameters)" << endl;
+
+            res.pps = measure_throughput(model, batch, nodes, evals);
+
+            auto start = chrono::steady_clock::now();
+            model.train(ntrain, inputs, mcts, results);
+            res.train_secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            model.validate(
+                holdout,
+                inputs + ntrain * OBSIZE,
+                mcts + ntrain * PSIZE,
+                results + ntrain,
+                &res.policy_loss,
+                &res.value_loss
+            );
+
+            results_table.push_back(res);
+        }
+    }
+
+    // Mark configurations not dominated in both throughput and loss
+    for (auto& a : results_table)
+    {
+        a.pareto = true;
+
+        for (auto& b : results_table)
+        {
+            if (&a == &b)
+                continue;
+
+            if (b.pps >= a.pps && b.loss() <= a.loss() && (b.pps > a.pps || b.loss() < a.loss()))
+            {
+                a.pareto = false;
+                break;
+            }
+        }
+    }
+
+    cout << "\n"
+         << setw(8) << "filters"
+         << setw(10) << "residuals"
+         << setw(12) << "params"
+         << setw(12) << "pos/s"
+         << setw(12) << "train s"
+         << setw(12) << "ploss"
+         << setw(12) << "vloss"
+         << "  pareto" << endl;
+
+    for (auto& r : results_table)
+    {
+        cout << setw(8) << r.filters
+             << setw(10) << r.residuals
+             << setw(12) << r.params
+             << setw(12) << fixed << setprecision(1) << r.pps
+             << setw(12) << setprecision(2) << r.train_secs
+             << setw(12) << setprecision(4) << r.policy_loss
+             << setw(12) << r.value_loss
+             << (r.pareto ? "  *" : "") << endl;
+    }
+
+    cout << "\nPareto frontier:";
+
+    for (auto& r : results_table)
+        if (r.pareto)
+            cout << " " << r.filters << "x" << r.residuals;
+
+    cout << endl;
+
+    delete[] inputs;
+    delete[] mcts;
+    delete[] results;
+
+    return 0;
+}